@@ -0,0 +1,55 @@
+// Compact WAD files in place: lump data is rewritten in table order with no gaps.
+//
+// Usage: wad_compact <file.wad>...
+// Archives another process has loaded, such as a mounted wadfs, are refused.
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sys/stat.h>
+#include "Wad.h"
+
+using namespace std;
+
+static long long fileSize(const char* path)
+{
+    struct stat st;
+    return (stat(path, &st) == 0) ? st.st_size : -1;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        cout << "Usage: " << argv[0] << " <file.wad>..." << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    int status = EXIT_SUCCESS;
+    for (int i = 1; i < argc; i++)
+    {
+        long long before = fileSize(argv[i]);
+
+        // Mapped, so only the new file is ever held in memory
+        Wad *myWad = Wad::loadWad(argv[i], LoadMode::Mmap, TreeMode::Lazy);
+        if (!myWad)
+        {
+            cerr << argv[i] << ": not a WAD file" << endl;
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        if (myWad->compact() < 0)
+        {
+            // Another process (a wadfs mount, say) has it loaded and would lose its writes
+            if (errno == EWOULDBLOCK)
+                cerr << argv[i] << ": in use by another process, not compacted" << endl;
+            else
+                cerr << argv[i] << ": compaction failed: " << strerror(errno) << endl;
+            status = EXIT_FAILURE;
+        }
+        else
+            cout << argv[i] << ": " << before << " -> " << fileSize(argv[i]) << " bytes" << endl;
+        delete myWad;
+    }
+    return status;
+}
@@ -3,37 +3,34 @@
 
 using namespace std;
 
-void exploreDirectory(Wad *data, const string path, int level)
+static void indent(int level)
 {
     for (int index = 0; index < level; index++)
         cout << " ";
+}
+
+void exploreDirectory(Wad *data, const string path)
+{
+    cout << "EXPLORING: " << path << endl;
 
-    vector<string> entries;
-    cout << "[Objects at this level:" << data->getDirectory(path, &entries) << "]" << endl;
+    // One depth-first walk, directories report their child count as size
+    indent(1);
+    cout << "[Objects at this level:" << data->stat(path).size << "]" << endl;
 
-    for (string entry : entries)
+    data->walkTree(path, [](int depth, string_view entry, const EntryInfo& info)
     {
-        string entryPath = path + entry;
-
-        for (int index = 0; index < level; index++)
-            cout << " ";
+        int level = depth + 1;
+        indent(level);
 
-        if (data->isDirectory(entryPath))
+        if (info.kind == EntryKind::Directory)
         {
             cout << level << ". DIR: " << entry << endl;
-            exploreDirectory(data, entryPath + "/", level + 1);
+            indent(level + 1);
+            cout << "[Objects at this level:" << info.size << "]" << endl;
         }
-        else if (data->isContent(entryPath))
-            cout << level << ". CONTENT: " << entry << "; Size: " << data->getSize(entryPath) << endl;
         else
-            cout << "***WARNING: entry " << entry << " has invalid type!***" << endl;
-    }
-}
-
-void exploreDirectory(Wad *data, const string path)
-{
-    cout << "EXPLORING: " << path << endl;
-    exploreDirectory(data, path, 1);
+            cout << level << ". CONTENT: " << entry << "; Size: " << info.size << endl;
+    });
 }
 
 int main(int argc, char** argv)
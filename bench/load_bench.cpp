@@ -0,0 +1,57 @@
+// Load-time scaling of Wad::loadWad by parse thread count.
+// Usage: load_bench [descriptors] [runs]
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "synthetic.h"
+
+// Median load time in ms
+static double timeLoad(const std::string& path, LoadMode mode, TreeMode tree, int runs)
+{
+    std::vector<double> times;
+    for (int r = 0; r < runs; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        Wad* wad = Wad::loadWad(path, mode, tree);
+        auto end = std::chrono::steady_clock::now();
+        if (!wad)
+            return -1;
+        delete wad;
+        times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    int runs = argc > 2 ? atoi(argv[2]) : 5;
+
+    std::string path = "/tmp/load_bench_" + std::to_string(getpid()) + ".wad";
+    SyntheticSpec spec;
+    spec.descriptors = count;
+    if (!writeSynthetic(path, spec)) {
+        fprintf(stderr, "Failed to write %s\n", path.c_str());
+        return 1;
+    }
+
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    printf("%u descriptors, %d runs, %u cores\n", count, runs, cores);
+    printf("%8s %12s %12s %12s\n", "threads", "eager ms", "lazy ms", "lazy mmap ms");
+    for (unsigned threads = 1; threads <= std::max(cores, 8u); threads *= 2) {
+        Wad::setLoadThreads(threads);
+        printf("%8u %12.1f %12.1f %12.1f\n", threads,
+            timeLoad(path, LoadMode::Buffered, TreeMode::Eager, runs),
+            timeLoad(path, LoadMode::Buffered, TreeMode::Lazy, runs),
+            timeLoad(path, LoadMode::Mmap, TreeMode::Lazy, runs));
+    }
+
+    unlink(path.c_str());
+    return 0;
+}
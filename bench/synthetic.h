@@ -0,0 +1,69 @@
+#pragma once
+// Synthetic WADs for benchmarks
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "Wad.h"
+
+struct SyntheticSpec {
+    uint32_t descriptors = 1000; // Lumps and markers, rounded down to whole namespaces
+    uint32_t perNamespace = 1000; // Lumps in each top-level namespace
+    uint32_t lumpSize = 16; // Every lump shares one block of this size
+    bool maps = true; // Start each namespace with an E#M# map of 10 lumps
+};
+
+// Two-char namespace name for index i, unique for the first 62 * 62
+inline std::string namespaceName(uint32_t i)
+{
+    static const char digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    return { digits[i / 62 % 62], digits[i % 62] };
+}
+
+// Lump names inside a synthetic namespace
+inline std::string lumpName(uint32_t i)
+{
+    return "L" + std::to_string(i);
+}
+
+inline bool writeSynthetic(const std::string& path, const SyntheticSpec& spec)
+{
+    std::vector<Descriptor> table;
+    table.reserve(spec.descriptors);
+    auto add = [&](const std::string& name, uint32_t length) {
+        Descriptor d {};
+        d.offset = length ? sizeof(Header) : 0;
+        d.length = length;
+        strncpy(d.name, name.c_str(), 8);
+        table.push_back(d);
+    };
+
+    uint32_t perNamespace = spec.perNamespace + 2 + (spec.maps ? 11 : 0);
+    for (uint32_t ns = 0; table.size() + perNamespace <= spec.descriptors || ns == 0; ++ns) {
+        std::string prefix = namespaceName(ns);
+        add(prefix + "_START", 0);
+        if (spec.maps) {
+            add("E1M1", 0);
+            for (int i = 0; i < 10; ++i)
+                add("MAP" + std::to_string(i), spec.lumpSize);
+        }
+        for (uint32_t i = 0; i < spec.perNamespace; ++i)
+            add(lumpName(i), spec.lumpSize);
+        add(prefix + "_END", 0);
+    }
+
+    Header h;
+    memcpy(h.magic, "PWAD", 4);
+    h.count = table.size();
+    h.offset = sizeof(Header) + spec.lumpSize;
+
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    std::vector<char> data(spec.lumpSize, 'x');
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+        && fwrite(data.data(), 1, data.size(), f) == data.size()
+        && fwrite(table.data(), sizeof(Descriptor), table.size(), f) == table.size();
+    return fclose(f) == 0 && ok;
+}
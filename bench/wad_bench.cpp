@@ -0,0 +1,347 @@
+// libWad operation benchmarks on synthetic WADs, from sample1.wad size up to 1M descriptors.
+// Write benchmarks report their complexity, so a quadratic path shows up as NSquared.
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <benchmark/benchmark.h>
+#include "synthetic.h"
+
+static const std::string scratchDir = "/tmp";
+
+// Generated WADs, one per spec, removed at exit
+static std::map<std::string, std::string> generated;
+
+static void removeGenerated()
+{
+    for (auto& entry : generated)
+        unlink(entry.second.c_str());
+}
+
+static const std::string& syntheticWad(const SyntheticSpec& spec)
+{
+    std::string key = std::to_string(spec.descriptors) + "_" + std::to_string(spec.perNamespace)
+        + "_" + std::to_string(spec.lumpSize) + "_" + std::to_string(spec.maps);
+    auto it = generated.find(key);
+    if (it != generated.end())
+        return it->second;
+
+    if (generated.empty())
+        atexit(removeGenerated);
+    std::string path = scratchDir + "/wad_bench_" + std::to_string(getpid()) + "_" + key + ".wad";
+    if (!writeSynthetic(path, spec))
+        abort();
+    return generated[key] = path;
+}
+
+static SyntheticSpec withDescriptors(uint32_t count)
+{
+    SyntheticSpec spec;
+    spec.descriptors = count;
+    spec.perNamespace = std::min<uint32_t>(1000, count / 2);
+    return spec;
+}
+
+// Writable copy of a generated WAD so write benchmarks start from the same state
+static std::string scratchCopy(const std::string& path)
+{
+    std::string copy = path + ".scratch";
+    std::string command = "cp " + path + " " + copy;
+    if (system(command.c_str()) != 0)
+        abort();
+    return copy;
+}
+
+/* Loading */
+
+static void BM_LoadEager(benchmark::State& state)
+{
+    const std::string& path = syntheticWad(withDescriptors(state.range(0)));
+    for (auto _ : state)
+        delete Wad::loadWad(path);
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_LoadEager)->RangeMultiplier(8)->Range(64, 1 << 20)->Unit(benchmark::kMillisecond)->Complexity();
+
+static void BM_LoadLazyMmap(benchmark::State& state)
+{
+    const std::string& path = syntheticWad(withDescriptors(state.range(0)));
+    for (auto _ : state)
+        delete Wad::loadWad(path, LoadMode::Mmap, TreeMode::Lazy);
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_LoadLazyMmap)->RangeMultiplier(8)->Range(64, 1 << 20)->Unit(benchmark::kMillisecond)->Complexity();
+
+/* Reading */
+
+// Path lookups spread over the whole tree, should not grow with the WAD
+static void BM_Resolve(benchmark::State& state)
+{
+    SyntheticSpec spec = withDescriptors(state.range(0));
+    Wad* wad = Wad::loadWad(syntheticWad(spec));
+    uint32_t namespaces = spec.descriptors / (spec.perNamespace + 13);
+
+    std::vector<std::string> paths;
+    for (uint32_t i = 0; i < 1024; ++i)
+        paths.push_back("/" + namespaceName(i * 7919 % std::max(1u, namespaces)) + "/"
+            + lumpName(i * 104729 % spec.perNamespace));
+
+    size_t i = 0;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(wad->getSize(paths[i++ % paths.size()]));
+    state.SetItemsProcessed(state.iterations());
+    state.SetComplexityN(state.range(0));
+    delete wad;
+}
+BENCHMARK(BM_Resolve)->RangeMultiplier(8)->Range(64, 1 << 20)->Complexity(benchmark::o1);
+
+static void BM_GetContents(benchmark::State& state)
+{
+    SyntheticSpec spec;
+    spec.lumpSize = state.range(0);
+    spec.descriptors = 100;
+    spec.perNamespace = 10;
+    Wad* wad = Wad::loadWad(syntheticWad(spec), state.range(1) ? LoadMode::Mmap : LoadMode::Buffered);
+    std::vector<char> buffer(spec.lumpSize);
+    std::string path = "/00/" + lumpName(0);
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(wad->getContents(path, buffer.data(), spec.lumpSize));
+    state.SetBytesProcessed(state.iterations() * spec.lumpSize);
+    delete wad;
+}
+BENCHMARK(BM_GetContents)->ArgNames({ "size", "mmap" })->ArgsProduct({ { 16, 4096, 65536, 1 << 20 }, { 0, 1 } });
+
+// Dump every lump of a 1000-lump namespace, one getContents per lump or one readAll
+static void BM_DumpNamespace(benchmark::State& state)
+{
+    SyntheticSpec spec;
+    spec.descriptors = 1013;
+    spec.lumpSize = 4096;
+    Wad* wad = Wad::loadWad(syntheticWad(spec), LoadMode::Mmap);
+    std::vector<char> buffer(spec.lumpSize);
+    uint64_t sum = 0;
+
+    for (auto _ : state) {
+        if (state.range(0)) {
+            wad->readAll("/00", [&](std::string_view, const char* data, uint32_t size) {
+                memcpy(buffer.data(), data, size);
+                sum += buffer[0];
+            });
+            continue;
+        }
+        std::vector<std::string> entries;
+        wad->getDirectory("/00", &entries);
+        for (const std::string& name : entries) {
+            std::string path = "/00/" + name;
+            if (wad->isContent(path))
+                sum += wad->getContents(path, buffer.data(), buffer.size());
+        }
+    }
+    benchmark::DoNotOptimize(sum);
+    state.SetItemsProcessed(state.iterations() * spec.perNamespace);
+    delete wad;
+}
+BENCHMARK(BM_DumpNamespace)->ArgName("readAll")->Arg(0)->Arg(1);
+
+// Listing one namespace of n lumps
+static void BM_GetDirectory(benchmark::State& state)
+{
+    SyntheticSpec spec;
+    spec.descriptors = state.range(0) + 13;
+    spec.perNamespace = state.range(0);
+    Wad* wad = Wad::loadWad(syntheticWad(spec));
+
+    std::vector<std::string> entries;
+    for (auto _ : state) {
+        entries.clear();
+        benchmark::DoNotOptimize(wad->getDirectory("/00", &entries));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetComplexityN(state.range(0));
+    delete wad;
+}
+BENCHMARK(BM_GetDirectory)->RangeMultiplier(8)->Range(8, 1 << 18)->Complexity();
+
+static void BM_VisitDirectory(benchmark::State& state)
+{
+    SyntheticSpec spec;
+    spec.descriptors = state.range(0) + 13;
+    spec.perNamespace = state.range(0);
+    Wad* wad = Wad::loadWad(syntheticWad(spec));
+
+    uint64_t sum = 0;
+    for (auto _ : state)
+        wad->visitDirectory("/00", [&](std::string_view name, const EntryInfo& info) {
+            sum += name.size() + info.size;
+        });
+    benchmark::DoNotOptimize(sum);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetComplexityN(state.range(0));
+    delete wad;
+}
+BENCHMARK(BM_VisitDirectory)->RangeMultiplier(8)->Range(8, 1 << 18)->Complexity();
+
+/* Writing, n operations per iteration on a fresh copy of a 100k descriptor WAD */
+
+static void BM_CreateFile(benchmark::State& state)
+{
+    const std::string& path = syntheticWad(withDescriptors(100000));
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::string copy = scratchCopy(path);
+        Wad* wad = Wad::loadWad(copy);
+        state.ResumeTiming();
+
+        for (int64_t i = 0; i < state.range(0); ++i)
+            wad->createFile("/00/N" + std::to_string(i));
+
+        state.PauseTiming();
+        delete wad;
+        unlink(copy.c_str());
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_CreateFile)->RangeMultiplier(4)->Range(64, 1 << 16)->Unit(benchmark::kMillisecond)->Complexity();
+
+static void BM_CreateDirectory(benchmark::State& state)
+{
+    const std::string& path = syntheticWad(withDescriptors(100000));
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::string copy = scratchCopy(path);
+        Wad* wad = Wad::loadWad(copy);
+        state.ResumeTiming();
+
+        // Two-char names, spread over parents so every name is unique
+        for (int64_t i = 0; i < state.range(0); ++i)
+            wad->createDirectory("/" + namespaceName(i / 3844) + "/" + namespaceName(i % 3844));
+
+        state.PauseTiming();
+        delete wad;
+        unlink(copy.c_str());
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_CreateDirectory)->RangeMultiplier(4)->Range(64, 1 << 16)->Unit(benchmark::kMillisecond)->Complexity();
+
+// Create and fill n small lumps, then flush them
+static void BM_WriteNewFiles(benchmark::State& state)
+{
+    const std::string& path = syntheticWad(withDescriptors(100000));
+    const char data[64] = {};
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::string copy = scratchCopy(path);
+        Wad* wad = Wad::loadWad(copy);
+        state.ResumeTiming();
+
+        for (int64_t i = 0; i < state.range(0); ++i) {
+            std::string file = "/01/N" + std::to_string(i);
+            wad->createFile(file);
+            wad->writeToFile(file, data, sizeof(data));
+        }
+        wad->flush();
+
+        state.PauseTiming();
+        delete wad;
+        unlink(copy.c_str());
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0) * sizeof(data));
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_WriteNewFiles)->RangeMultiplier(4)->Range(64, 1 << 16)->Unit(benchmark::kMillisecond)->Complexity();
+
+// Grow one lump by n 4 KiB appends, the streaming pattern of wadfs writes
+static void BM_AppendStream(benchmark::State& state)
+{
+    const std::string& path = syntheticWad(withDescriptors(100000));
+    std::vector<char> chunk(4096, 'a');
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::string copy = scratchCopy(path);
+        Wad* wad = Wad::loadWad(copy);
+        wad->createFile("/02/STREAM");
+        state.ResumeTiming();
+
+        for (int64_t i = 0; i < state.range(0); ++i)
+            wad->writeToFile("/02/STREAM", chunk.data(), chunk.size(), i * chunk.size());
+        wad->flush();
+
+        state.PauseTiming();
+        delete wad;
+        unlink(copy.c_str());
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0) * chunk.size());
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_AppendStream)->RangeMultiplier(4)->Range(16, 1 << 14)->Unit(benchmark::kMillisecond)->Complexity();
+
+// Rewrite a lump on disk at its size and flush, the file must not grow
+static void BM_OverwriteLump(benchmark::State& state)
+{
+    SyntheticSpec spec;
+    spec.lumpSize = state.range(0);
+    spec.descriptors = 100;
+    spec.perNamespace = 10;
+    std::string copy = scratchCopy(syntheticWad(spec));
+    Wad* wad = Wad::loadWad(copy, state.range(1) ? LoadMode::Mmap : LoadMode::Buffered);
+    std::vector<char> data(spec.lumpSize, 'b');
+
+    // Generated lumps all share one block, so rewrite a lump of its own
+    std::string path = "/00/OWN";
+    wad->createFile(path);
+    wad->writeToFile(path, data.data(), spec.lumpSize);
+    wad->flush();
+
+    for (auto _ : state) {
+        wad->writeToFile(path, data.data(), spec.lumpSize);
+        wad->flush();
+    }
+    state.SetBytesProcessed(state.iterations() * spec.lumpSize);
+    delete wad;
+    unlink(copy.c_str());
+}
+BENCHMARK(BM_OverwriteLump)->ArgNames({ "size", "mmap" })->ArgsProduct({ { 4096, 65536 }, { 0, 1 } });
+
+// Rewrite n lumps at changing sizes and flush, growth is how far the file got past its start
+static void BM_RewriteChurn(benchmark::State& state)
+{
+    const std::string& path = syntheticWad(withDescriptors(1000));
+    std::string copy = scratchCopy(path);
+    Wad* wad = Wad::loadWad(copy);
+    std::vector<std::string> lumps;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        lumps.push_back("/00/C" + std::to_string(i));
+        wad->createFile(lumps.back());
+    }
+    wad->flush();
+    struct stat st;
+    stat(copy.c_str(), &st);
+    off_t initial = st.st_size;
+
+    std::vector<char> data(16384, 'c');
+    uint32_t round = 0;
+    for (auto _ : state) {
+        for (const std::string& lump : lumps) {
+            uint32_t size = 1024 + (++round * 7919) % 15360;
+            wad->truncateFile(lump, 0);
+            wad->writeToFile(lump, data.data(), size);
+        }
+        wad->flush();
+    }
+    stat(copy.c_str(), &st);
+    state.counters["growth"] = st.st_size - initial;
+    delete wad;
+    unlink(copy.c_str());
+}
+BENCHMARK(BM_RewriteChurn)->Arg(16)->Arg(256);
+
+BENCHMARK_MAIN();
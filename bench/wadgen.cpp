@@ -0,0 +1,267 @@
+// Generate a valid WAD of any scale for benchmarks and stress tests.
+//
+// Usage: wadgen [options] <output.wad>
+//   -n, --count N       total descriptors, markers included (default 100000)
+//   -d, --depth D       namespace nesting depth (default 2)
+//   -f, --fanout F      child namespaces per namespace, at most 3844 (default 8)
+//   -m, --maps M        E#M# maps of 10 lumps at the root, at most 90 (default 4)
+//   -s, --size DIST     lump sizes: fixed:N, uniform:MIN:MAX or lognormal:MEDIAN:SIGMA
+//                       (default lognormal:4096:1.5)
+//   -r, --seed S        random seed (default 1)
+//   -v, --verify        load the result with libWad and report the load time
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <getopt.h>
+#include <random>
+#include <string>
+#include <vector>
+#include "synthetic.h"
+
+struct SizeDist {
+    enum { Fixed, Uniform, LogNormal } kind = LogNormal;
+    double a = 4096, b = 1.5;
+};
+
+static bool parseSize(const char* arg, SizeDist& dist)
+{
+    double a = 0, b = 0;
+    if (sscanf(arg, "fixed:%lf", &a) == 1) {
+        dist = { SizeDist::Fixed, a, 0 };
+        return a >= 0;
+    }
+    if (sscanf(arg, "uniform:%lf:%lf", &a, &b) == 2) {
+        dist = { SizeDist::Uniform, a, b };
+        return a >= 0 && b >= a;
+    }
+    if (sscanf(arg, "lognormal:%lf:%lf", &a, &b) == 2) {
+        dist = { SizeDist::LogNormal, a, b };
+        return a > 0 && b >= 0;
+    }
+    return false;
+}
+
+// Plain lump name for index i. The digits after the L are base 62, so even a directory
+// with UINT32_MAX lumps has unique names that fit in 8 characters.
+static std::string shortLumpName(uint64_t i)
+{
+    static const char digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    std::string name;
+    do {
+        name.insert(name.begin(), digits[i % 62]);
+        i /= 62;
+    } while (i > 0);
+    return "L" + name;
+}
+
+// Lump names of a map, in the order DOOM stores them
+static const char* const mapLumps[] = { "THINGS", "LINEDEFS", "SIDEDEFS", "VERTEXES", "SEGS",
+    "SSECTORS", "NODES", "SECTORS", "REJECT", "BLOCKMAP" };
+
+class Generator {
+public:
+    Generator(FILE* out, const SizeDist& dist, uint32_t seed)
+        : out(out)
+        , dist(dist)
+        , rng(seed)
+        , pattern(1 << 20)
+    {
+        for (size_t i = 0; i < pattern.size(); ++i)
+            pattern[i] = static_cast<char>(rng());
+    }
+
+    // Marker with no data
+    void marker(const std::string& name) { table.push_back(descriptor(name, 0, 0)); }
+
+    // Lump with data drawn from the size distribution
+    bool lump(const std::string& name)
+    {
+        uint64_t size = drawSize();
+        if (dataEnd + size > UINT32_MAX) {
+            fprintf(stderr, "WAD offsets are 32-bit, data would pass 4 GiB\n");
+            return false;
+        }
+
+        table.push_back(descriptor(name, dataEnd, size));
+        uint64_t done = 0;
+        while (done < size) {
+            size_t start = (dataEnd + done) % pattern.size();
+            size_t n = std::min<uint64_t>(size - done, pattern.size() - start);
+            if (fwrite(pattern.data() + start, 1, n, out) != n)
+                return false;
+            done += n;
+        }
+        dataEnd += size;
+        return true;
+    }
+
+    // Table after the data, then the real header at the front
+    bool finish()
+    {
+        Header h;
+        memcpy(h.magic, "PWAD", 4);
+        h.count = table.size();
+        h.offset = dataEnd;
+        return fwrite(table.data(), sizeof(Descriptor), table.size(), out) == table.size()
+            && fseek(out, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, out) == 1;
+    }
+
+    size_t descriptors() const { return table.size(); }
+    uint64_t bytes() const { return dataEnd; }
+
+private:
+    static Descriptor descriptor(const std::string& name, uint32_t offset, uint32_t length)
+    {
+        Descriptor d {};
+        d.offset = offset;
+        d.length = length;
+        strncpy(d.name, name.c_str(), 8);
+        return d;
+    }
+
+    uint64_t drawSize()
+    {
+        double size = dist.a;
+        if (dist.kind == SizeDist::Uniform)
+            size = std::uniform_real_distribution<double>(dist.a, dist.b + 1)(rng);
+        else if (dist.kind == SizeDist::LogNormal)
+            size = std::lognormal_distribution<double>(std::log(dist.a), dist.b)(rng);
+        return static_cast<uint64_t>(std::min(size, (double)UINT32_MAX));
+    }
+
+    FILE* out;
+    SizeDist dist;
+    std::mt19937 rng;
+    std::vector<char> pattern; // Lump bytes cycle through this
+    std::vector<Descriptor> table;
+    uint64_t dataEnd = sizeof(Header);
+};
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+        "Usage: %s [-n count] [-d depth] [-f fanout] [-m maps] [-s fixed:N|uniform:MIN:MAX|"
+        "lognormal:MEDIAN:SIGMA] [-r seed] [-v] <output.wad>\n",
+        prog);
+}
+
+int main(int argc, char* argv[])
+{
+    uint64_t count = 100000;
+    uint32_t depth = 2, fanout = 8, maps = 4, seed = 1;
+    bool verify = false;
+    SizeDist dist;
+
+    static const option longOpts[] = { { "count", required_argument, nullptr, 'n' },
+        { "depth", required_argument, nullptr, 'd' }, { "fanout", required_argument, nullptr, 'f' },
+        { "maps", required_argument, nullptr, 'm' }, { "size", required_argument, nullptr, 's' },
+        { "seed", required_argument, nullptr, 'r' }, { "verify", no_argument, nullptr, 'v' },
+        { nullptr, 0, nullptr, 0 } };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:d:f:m:s:r:v", longOpts, nullptr)) != -1) {
+        switch (opt) {
+        case 'n': count = strtoull(optarg, nullptr, 10); break;
+        case 'd': depth = strtoul(optarg, nullptr, 10); break;
+        case 'f': fanout = strtoul(optarg, nullptr, 10); break;
+        case 'm': maps = strtoul(optarg, nullptr, 10); break;
+        case 'r': seed = strtoul(optarg, nullptr, 10); break;
+        case 'v': verify = true; break;
+        case 's':
+            if (parseSize(optarg, dist))
+                break;
+            fprintf(stderr, "Bad size distribution %s\n", optarg);
+            return 1;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || fanout == 0 || fanout > 62 * 62 || maps > 90) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string path = argv[optind];
+
+    // Namespaces in the full tree, each costs a _START and an _END
+    uint64_t namespaces = 0, level = 1;
+    for (uint32_t d = 0; d < depth; ++d) {
+        level *= fanout;
+        namespaces += level;
+    }
+    if (count < 2 * namespaces + 11ull * maps || count > UINT32_MAX) {
+        fprintf(stderr, "%llu descriptors cannot hold %llu namespaces and %u maps\n",
+            (unsigned long long)count, (unsigned long long)namespaces, maps);
+        return 1;
+    }
+
+    // Plain lumps spread evenly over the root and every namespace
+    uint64_t lumps = count - 2 * namespaces - 11ull * maps;
+    uint64_t dirs = namespaces + 1, placed = 0, dirIndex = 0;
+    auto lumpsFor = [&]() {
+        uint64_t n = lumps / dirs + (dirIndex++ < lumps % dirs ? 1 : 0);
+        placed += n;
+        return n;
+    };
+
+    FILE* out = fopen(path.c_str(), "wb");
+    if (!out) {
+        perror(path.c_str());
+        return 1;
+    }
+    std::vector<char> ioBuffer(1 << 22);
+    setvbuf(out, ioBuffer.data(), _IOFBF, ioBuffer.size());
+
+    // Header placeholder, rewritten once the table offset is known
+    Header blank {};
+    bool ok = fwrite(&blank, sizeof(blank), 1, out) == 1;
+    Generator gen(out, dist, seed);
+
+    for (uint32_t m = 0; ok && m < maps; ++m) {
+        gen.marker("E" + std::to_string(m / 9) + "M" + std::to_string(m % 9 + 1));
+        for (const char* name : mapLumps)
+            ok = ok && gen.lump(name);
+    }
+
+    std::function<bool(uint32_t)> emit = [&](uint32_t level) {
+        for (uint64_t i = 0, n = lumpsFor(); i < n; ++i)
+            if (!gen.lump(shortLumpName(i)))
+                return false;
+        if (level == depth)
+            return true;
+        for (uint32_t c = 0; c < fanout; ++c) {
+            std::string name = namespaceName(c);
+            gen.marker(name + "_START");
+            if (!emit(level + 1))
+                return false;
+            gen.marker(name + "_END");
+        }
+        return true;
+    };
+    ok = ok && emit(0) && gen.finish();
+    if (fclose(out) != 0 || !ok) {
+        fprintf(stderr, "Failed to write %s\n", path.c_str());
+        return 1;
+    }
+
+    printf("%s: %zu descriptors, %llu namespaces, %u maps, %.1f MiB of lump data\n", path.c_str(),
+        gen.descriptors(), (unsigned long long)namespaces, maps, gen.bytes() / 1048576.0);
+
+    if (verify) {
+        auto start = std::chrono::steady_clock::now();
+        Wad* wad = Wad::loadWad(path, LoadMode::Mmap, TreeMode::Lazy);
+        auto end = std::chrono::steady_clock::now();
+        if (!wad) {
+            fprintf(stderr, "libWad rejected %s\n", path.c_str());
+            return 1;
+        }
+        std::vector<std::string> entries;
+        printf("loaded in %.1f ms, %d root entries\n",
+            std::chrono::duration<double, std::milli>(end - start).count(),
+            wad->getDirectory("/", &entries));
+        delete wad;
+    }
+    return 0;
+}
@@ -1,19 +1,178 @@
 #include "Wad.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
-#include <fstream>
+#include <fcntl.h>
 #include <iostream>
+#include <mutex>
 #include <stack>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Helper functions */
 
-// For use with namespace markers
-bool endsWith(const std::string& str, const std::string& suffix)
+// Pack a name of at most 8 chars into an integer key, false if it cannot be a WAD name
+static bool packName(const char* name, size_t len, uint64_t& out)
 {
-    return str.size() >= suffix.size()
-        && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+    if (len == 0 || len > 8)
+        return false;
+    out = 0;
+    memcpy(&out, name, len);
+    return true;
 }
 
+// Whether path now names another file than the one opened, compact() renames over it
+static bool renamedOver(const std::string& path, const struct stat& opened)
+{
+    struct stat current;
+    return ::stat(path.c_str(), &current) == 0
+        && (current.st_dev != opened.st_dev || current.st_ino != opened.st_ino);
+}
+
+// Write all of buf at offset, retrying short writes
+static bool writeAll(int fd, const char* buf, size_t len, size_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// What a descriptor means for the tree
+enum class Marker : uint8_t { Lump, Map, Start, End };
+
+struct Classified {
+    Marker kind;
+    uint8_t nameLen;
+};
+
+/* Marker classification. A descriptor name is exactly 8 bytes, so it is
+   handled as one 64-bit word with byte i in bits 8i..8i+7. */
+
+static const uint64_t lowBits = 0x0101010101010101ull;
+static const uint64_t highBits = 0x8080808080808080ull;
+
+static inline uint64_t nameWord(const char* name)
+{
+    uint64_t w;
+    memcpy(&w, name, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+// Word of a literal of at most 8 chars
+static constexpr uint64_t literalWord(const char* s, size_t i = 0)
+{
+    return i == 8 || s[i] == 0 ? 0 : (uint64_t)(uint8_t)s[i] << (8 * i) | literalWord(s, i + 1);
+}
+
+// Length of a NUL padded name. Borrows only set bits above the first zero byte.
+static inline size_t wordLength(uint64_t w)
+{
+    uint64_t zeros = (w - lowBits) & ~w & highBits;
+    return zeros ? __builtin_ctzll(zeros) / 8 : 8;
+}
+
+// Classify the first len bytes of a name word, whatever follows them
+static Marker classifyWord(uint64_t w, size_t len)
+{
+    if (len < 8)
+        w &= (1ull << (8 * len)) - 1;
+
+    // Map markers look like E#M#
+    if (len == 4 && (w & 0x00FF00FF) == ('E' | 'M' << 16)
+        && (uint8_t)((w >> 8) - '0') < 10 && (uint8_t)((w >> 24) - '0') < 10)
+        return Marker::Map;
+    if (len >= 6 && w >> (8 * (len - 6)) == literalWord("_START"))
+        return Marker::Start;
+    if (len >= 4 && w >> (8 * (len - 4)) == literalWord("_END"))
+        return Marker::End;
+    return Marker::Lump;
+}
+
+// Classify a name of at most 8 chars given as a string
+static Marker classifyName(const char* name, size_t len)
+{
+    char padded[8] = {};
+    memcpy(padded, name, std::min<size_t>(len, 8));
+    return classifyWord(nameWord(padded), len);
+}
+
+// Classify the names of descriptors [first, last) of a raw table
+static void classifyNames(const char* table, uint32_t first, uint32_t last, Classified* out)
+{
+    uint32_t i = first;
+#ifdef __SSE2__
+    static_assert(sizeof(Descriptor) == 16 && offsetof(Descriptor, name) == 8,
+        "two descriptors fill two vectors, names in the high halves");
+
+    // Two names per vector: lengths come from a zero-byte mask, and a name with no '_'
+    // that is not 4 long can only be a lump, which covers almost every descriptor
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i underscore = _mm_set1_epi8('_');
+    for (; i + 2 <= last; i += 2) {
+        const char* p = table + (size_t)i * sizeof(Descriptor);
+        __m128i names = _mm_unpackhi_epi64(_mm_loadu_si128((const __m128i*)p),
+            _mm_loadu_si128((const __m128i*)(p + sizeof(Descriptor))));
+        unsigned zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(names, zero));
+        unsigned unders = _mm_movemask_epi8(_mm_cmpeq_epi8(names, underscore));
+
+        for (unsigned k = 0; k < 2; ++k) {
+            size_t len = __builtin_ctz(((zeros >> (8 * k)) & 0xFF) | 0x100);
+            bool plain = len != 4 && ((unders >> (8 * k)) & ((1u << len) - 1)) == 0;
+            Marker kind = plain ? Marker::Lump
+                                : classifyWord(nameWord(p + k * sizeof(Descriptor) + 8), len);
+            out[i + k] = Classified { kind, static_cast<uint8_t>(len) };
+        }
+    }
+#endif
+    // Scalar fallback and leftover
+    for (; i < last; ++i) {
+        uint64_t w = nameWord(table + (size_t)i * sizeof(Descriptor) + offsetof(Descriptor, name));
+        size_t len = wordLength(w);
+        out[i] = Classified { classifyWord(w, len), static_cast<uint8_t>(len) };
+    }
+}
+
+// Classify descriptors [first, last) of a raw table. False if a lump lies outside the file.
+static bool classifyRange(const char* table, uint32_t first, uint32_t last, uint64_t fsize,
+    Classified* out)
+{
+    classifyNames(table, first, last, out);
+
+    for (uint32_t i = first; i < last; ++i) {
+        Descriptor d;
+        memcpy(&d, table + (size_t)i * sizeof(Descriptor), sizeof(Descriptor));
+        if (d.length > 0 && (uint64_t)d.offset + d.length > fsize)
+            return false;
+    }
+    return true;
+}
+
+// Threads used to classify large tables, 0 means one per core
+static std::atomic<unsigned> loadThreads { 0 };
+
+// Tables smaller than this many descriptors per thread are not worth splitting
+static const uint32_t minChunk = 1 << 15;
+
 // Normalize path
 std::string norm(const std::string& p)
 {
@@ -24,75 +183,226 @@ std::string norm(const std::string& p)
     return s;
 }
 
-// Wad implementation
+// Free extents
 
-// Destructor
-Wad::~Wad()
+void FreeExtents::add(uint32_t offset, uint32_t length)
 {
-    if (!root)
+    if (length == 0)
         return;
+    bytes += length;
+
+    // Absorb the neighbours this extent touches
+    uint64_t start = offset, end = (uint64_t)offset + length;
+    auto next = byOffset.lower_bound(offset);
+    if (next != byOffset.begin()) {
+        auto prev = std::prev(next);
+        if ((uint64_t)prev->first + prev->second == start) {
+            start = prev->first;
+            bySize.erase({ prev->second, prev->first });
+            byOffset.erase(prev);
+        }
+    }
+    if (next != byOffset.end() && next->first == end) {
+        end += next->second;
+        bySize.erase({ next->second, next->first });
+        byOffset.erase(next);
+    }
 
-    std::vector<Node*> stack;
-    stack.push_back(root);
+    byOffset.emplace(start, end - start);
+    bySize.emplace(end - start, start);
+}
 
-    while (!stack.empty()) {
-        Node* n = stack.back();
-        stack.pop_back();
+bool FreeExtents::take(uint32_t length, uint32_t& offset)
+{
+    auto it = bySize.lower_bound({ length, 0 });
+    if (it == bySize.end())
+        return false;
+
+    auto [size, start] = *it;
+    bySize.erase(it);
+    byOffset.erase(start);
+    bytes -= size;
+
+    // The rest stays free
+    offset = start;
+    if (size > length) {
+        byOffset.emplace(start + length, size - length);
+        bySize.emplace(size - length, start + length);
+        bytes += size - length;
+    }
+    return true;
+}
 
-        for (Node* ch : n->children)
-            stack.push_back(ch);
+bool FreeExtents::takeEndingAt(uint64_t end, uint32_t& offset)
+{
+    auto it = byOffset.lower_bound(end);
+    if (it == byOffset.begin())
+        return false;
+    --it;
+    if ((uint64_t)it->first + it->second != end)
+        return false;
+
+    offset = it->first;
+    bytes -= it->second;
+    bySize.erase({ it->second, it->first });
+    byOffset.erase(it);
+    return true;
+}
 
-        delete n;
-    }
+// Wad implementation
+
+// Destructor
+Wad::~Wad()
+{
+    // Persist anything still pending
+    flush();
+
+    if (mapBase)
+        munmap(mapBase, mapSize);
+    if (fd >= 0)
+        close(fd);
+
+    // Nodes live in the arena, which frees everything in one go
 }
 
-Wad* Wad::loadWad(const std::string& path)
+Wad* Wad::loadWad(const std::string& path, LoadMode mode, TreeMode tree)
 {
     // Construct new default WAD
     Wad* wad = new Wad();
+    wad->path = path;
+
+    // Open file, read-only if it cannot be written back. A shared lock is held while the
+    // file is loaded, compact() needs it exclusively. If a compaction replaced the file
+    // while we waited for the lock, open the new one.
+    struct stat st;
+    for (;;) {
+        wad->fd = open(path.c_str(), O_RDWR);
+        if (wad->fd < 0)
+            wad->fd = open(path.c_str(), O_RDONLY);
+
+        // Make sure file opens correctly
+        if (wad->fd < 0 || flock(wad->fd, LOCK_SH) < 0 || fstat(wad->fd, &st) < 0) {
+            delete wad;
+            return nullptr;
+        }
 
-    // Open file
-    std::ifstream file(path, std::ios::binary | std::ios::in | std::ios::ate);
-
-    // Make sure file opens correctly
-    if (!file)
-        return nullptr;
-
-    // Get size of file and resize vector
-    size_t fsize = file.tellg();
-    wad->fileData.resize(fsize);
+        if (!renamedOver(path, st))
+            break;
+        close(wad->fd);
+    }
+    size_t fsize = st.st_size;
+    const char* image;
+
+    if (mode == LoadMode::Mmap && fsize > 0) {
+        // Map file without reading it
+        void* base = mmap(nullptr, fsize, PROT_READ, MAP_SHARED, wad->fd, 0);
+        if (base == MAP_FAILED) {
+            delete wad;
+            return nullptr;
+        }
 
-    // Go to beginning of file and read to vector
-    file.seekg(0);
-    file.read(wad->fileData.data(), fsize);
+        wad->mapBase = base;
+        wad->mapSize = fsize;
+        image = static_cast<const char*>(base);
+    } else {
+        // Read whole file to vector
+        wad->fileData.resize(fsize);
+        size_t done = 0;
+        while (done < fsize) {
+            ssize_t n = pread(wad->fd, wad->fileData.data() + done, fsize - done, done);
+            if (n <= 0) {
+                delete wad;
+                return nullptr;
+            }
+            done += n;
+        }
+        image = wad->fileData.data();
+    }
 
     // Copy header information
-    memcpy(&wad->header, wad->fileData.data(), sizeof(Header));
+    if (fsize < sizeof(Header)) {
+        delete wad;
+        return nullptr;
+    }
+    memcpy(&wad->header, image, sizeof(Header));
+
+    // Make sure descriptor table lies inside the file
+    if ((uint64_t)wad->header.offset + (uint64_t)wad->header.count * sizeof(Descriptor) > fsize) {
+        delete wad;
+        return nullptr;
+    }
 
-    // Copy descriptors from file into vector
-    wad->descriptors.resize(wad->header.count);
-    char* descStart = wad->fileData.data() + wad->header.offset;
-    memcpy(wad->descriptors.data(), descStart, wad->header.count * sizeof(Descriptor));
+    size_t tableSize = wad->header.count * sizeof(Descriptor);
+    const char* table = image + wad->header.offset;
+
+    // Classify every descriptor in parallel chunks, the tree links below are serial
+    uint32_t count = wad->header.count;
+    std::vector<Classified> kinds(count);
+    unsigned threads = loadThreads ? loadThreads.load() : std::thread::hardware_concurrency();
+    threads = std::max(1u, std::min<unsigned>(threads, count / minChunk));
+
+    std::vector<char> chunkOk(threads, 0);
+    auto work = [&](unsigned t) {
+        uint32_t first = (uint64_t)count * t / threads;
+        uint32_t last = (uint64_t)count * (t + 1) / threads;
+        chunkOk[t] = classifyRange(table, first, last, fsize, kinds.data());
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t)
+        pool.emplace_back(work, t);
+    work(0);
+    for (std::thread& th : pool)
+        th.join();
+
+    // Lump data has to be inside the file
+    if (std::count(chunkOk.begin(), chunkOk.end(), 0) > 0) {
+        delete wad;
+        return nullptr;
+    }
 
-    // Build directory tree
-    wad->root = new Node { "/", true, 0, 0, nullptr, {}, 0 };
+    // New lumps are appended at dataEnd. The table stays in use until a flush has replaced
+    // it, even at the tail, so a failed flush never leaves the header pointing at lump data.
+    wad->dataEnd = fsize;
+    wad->flushedEnd = wad->dataEnd;
+
+    // Gaps between lumps and the table are free space
+    std::vector<std::pair<uint32_t, uint32_t>> used;
+    used.reserve(count + 1);
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t extent[2];
+        memcpy(extent, table + (size_t)i * sizeof(Descriptor), sizeof(extent));
+        if (extent[1] > 0)
+            used.emplace_back(extent[0], extent[1]);
+    }
+    if (tableSize > 0)
+        used.emplace_back(wad->header.offset, tableSize);
+    wad->scanExtents(used);
+    if (!wad->sharedData(wad->header.offset, tableSize))
+        wad->tableBytes = tableSize;
+
+    // Build directory tree, root has no marker and appends at the end of the table.
+    // Lazy trees only create directories here and queue everything else.
+    bool lazy = tree == TreeMode::Lazy;
+    wad->root = wad->newNode("/", 1, true, wad->descriptors.end());
+    wad->root->loaded = !lazy;
     std::stack<Node*> dirStack;
     dirStack.push(wad->root);
 
     int mapCounter = 0;
 
-    for (size_t i = 0; i < wad->descriptors.size(); ++i) {
-        Descriptor& d = wad->descriptors[i];
-        std::string name(d.name, strnlen(d.name, 8));
+    for (uint32_t i = 0; i < count; ++i) {
+        // Copy descriptor from file into list
+        auto it = wad->descriptors.emplace(wad->descriptors.end());
+        memcpy(&*it, table + (size_t)i * sizeof(Descriptor), sizeof(Descriptor));
+        const char* name = it->name;
+        size_t len = kinds[i].nameLen;
 
+        switch (kinds[i].kind) {
         // Deal with Map Marker
-        if (name.size() == 4 && name[0] == 'E' && std::isdigit(name[1]) && name[2] == 'M'
-            && std::isdigit(name[3])) {
+        case Marker::Map: {
             // Add new directory to directory tree
-            Node* mapDir = new Node { name, true, d.offset, d.length };
-            mapDir->parent = dirStack.top();
-            mapDir->descIndex = i;
-            dirStack.top()->children.push_back(mapDir);
+            Node* mapDir = wad->newNode(name, len, true, it);
+            wad->attach(dirStack.top(), mapDir, it);
             // Make most recent directory
             dirStack.push(mapDir);
             mapCounter = 10;
@@ -101,86 +411,167 @@ Wad* Wad::loadWad(const std::string& path)
 
         // Deal with Namespace Markers
         // _START
-        if (endsWith(name, "_START")) {
-            // Get namespace name
-            std::string new_name = name.substr(0, name.size() - 6);
-            // Add new directory to directory tree
-            Node* namespaceDir = new Node { new_name, true, d.offset, d.length };
-            namespaceDir->parent = dirStack.top();
-            namespaceDir->descIndex = i;
-            dirStack.top()->children.push_back(namespaceDir);
+        case Marker::Start: {
+            // Add new directory named after the prefix to directory tree
+            Node* namespaceDir = wad->newNode(name, len - 6, true, it);
+            wad->attach(dirStack.top(), namespaceDir, it);
             // Make most recent directory
             dirStack.push(namespaceDir);
             continue;
         }
 
         // _END
-        if (endsWith(name, "_END")) {
-            // Remove directory from stack
-            dirStack.pop();
+        case Marker::End:
+            // Remember where the namespace ends and remove directory from stack
+            if (dirStack.size() > 1) {
+                dirStack.top()->end = it;
+                dirStack.pop();
+            }
             continue;
-        }
 
         // Lumps
-        Node* fileNode = new Node { name, false, d.offset, d.length };
-        fileNode->parent = dirStack.top();
-        fileNode->descIndex = i;
-        dirStack.top()->children.push_back(fileNode);
+        case Marker::Lump:
+            if (lazy)
+                dirStack.top()->pending.push_back(PendingChild { it, nullptr });
+            else
+                wad->addChild(dirStack.top(), wad->newNode(name, len, false, it));
+            break;
+        }
 
         // Check if still in Map Marker
         if (mapCounter > 0 && --mapCounter == 0)
             dirStack.pop();
     }
 
+    if (wad->mapBase)
+        wad->fileBase = wad->dataEnd;
+    else
+        wad->fileData.resize(wad->dataEnd);
+
     return wad;
 }
 
-std::string Wad::getMagic() { return std::string(header.magic, 4); }
+std::string Wad::getMagic()
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+    return std::string(header.magic, 4);
+}
 
 bool Wad::isContent(const std::string& path)
 {
-    std::string clean = norm(path);
-    if (clean.empty()) return false;
-
-    Node* n = resolve(clean);
+    std::shared_lock<std::shared_mutex> guard(lock);
+    Node* n = lookup(path, guard);
     return n && !n->isDir;
 }
 
 bool Wad::isDirectory(const std::string& path)
 {
-    std::string clean = norm(path);
-    if (clean.empty()) return false;
-
-    Node* node = resolve(clean);
+    std::shared_lock<std::shared_mutex> guard(lock);
+    Node* node = lookup(path, guard);
     return node && node->isDir;
 }
 
 int Wad::getSize(const std::string& path)
 {
-    std::string clean = norm(path);
-    if (clean.empty()) return false;
-
-    Node* node = resolve(clean);
+    std::shared_lock<std::shared_mutex> guard(lock);
+    Node* node = lookup(path, guard);
     return (node && !node->isDir) ? (node->length) : -1;
 }
 
-int Wad::getContents(const std::string& path, char* buffer, int length, int offset)
+EntryInfo Wad::stat(const std::string& path)
 {
-    std::string clean = norm(path);
-    if (clean.empty()) return false;
+    std::shared_lock<std::shared_mutex> guard(lock);
+    Node* node = lookup(path, guard);
+    if (!node)
+        return EntryInfo { EntryKind::Missing, 0, 0, -1 };
+    return infoOf(node);
+}
 
+int Wad::getContents(const std::string& path, char* buffer, int length, int offset)
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
     // Get node from path
-    Node* node = resolve(clean);
-    if (!node || node->isDir || !buffer || length <= 0)
+    return readNode(lookup(path, guard), buffer, length, offset);
+}
+
+EntryInfo Wad::stat(int64_t handle)
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+    Node* node = fromHandle(handle);
+    if (!node)
+        return EntryInfo { EntryKind::Missing, 0, 0, -1 };
+    return infoOf(node);
+}
+
+EntryInfo Wad::lookupChild(int64_t dir, std::string_view name)
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+    Node* parent = expandHandle(dir, guard, Expand::Children);
+    Node* node = (parent && parent->isDir) ? findChild(parent, name.data(), name.size()) : nullptr;
+    if (!node)
+        return EntryInfo { EntryKind::Missing, 0, 0, -1 };
+    return infoOf(node);
+}
+
+int64_t Wad::openLump(const std::string& path)
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+    Node* node = lookup(path, guard);
+    if (!node || node->isDir)
         return -1;
+    return node->id;
+}
+
+int Wad::readLump(int64_t handle, char* buffer, int length, int offset)
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+    return readNode(fromHandle(handle), buffer, length, offset);
+}
+
+int Wad::locateLump(int64_t handle, int length, int offset, int* fdOut, uint64_t* filePos)
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+    Node* node = fromHandle(handle);
+    if (!node || node->isDir || length <= 0 || offset < 0 || !fdOut || !filePos)
+        return -1;
+
+    if ((uint32_t)offset >= node->length)
+        return 0;
+
+    // Same clamping as readNode
+    uint32_t available = node->length - offset;
+    uint32_t nbytes = ((uint32_t)length < available) ? length : available;
+
+    // Lumps written since the last flush only exist in fileData, and while compact() waits
+    // to swap files everything is read through readLump
+    *filePos = (uint64_t)node->offset + offset;
+    *fdOut = (!draining && node->offset + node->length <= flushedEnd) ? fd : -1;
+    if (*fdOut >= 0)
+        ++located;
+    return nbytes;
+}
+
+void Wad::releaseLocated()
+{
+    // The lock orders this after compact() starting to wait, so the wakeup is not lost
+    if (--located == 0 && draining) {
+        std::shared_lock<std::shared_mutex> guard(lock);
+        unlocated.notify_all();
+    }
+}
 
-    if (offset >= node->length)
+int Wad::readNode(Node* node, char* buffer, int length, int offset)
+{
+    if (!node || node->isDir || !buffer || length <= 0 || offset < 0)
+        return -1;
+
+    if ((uint32_t)offset >= node->length)
 	return 0;
 
     // Calculate size/location of contents that is being retrieved
     size_t available = node->length - offset;
-    size_t nbytes = (length < available) ? length : available;
-    char* lumpStart = fileData.data() + node->offset + offset;
+    size_t nbytes = std::min<size_t>(length, available);
+    const char* lumpStart = bytes(node->offset + offset);
 
     // Copy contents to buffer
     memcpy(buffer, lumpStart, nbytes);
@@ -188,18 +579,101 @@ int Wad::getContents(const std::string& path, char* buffer, int length, int offs
     return nbytes;
 }
 
+// Lumps in file order, so the copy loop walks the image front to back
+static void sortByOffset(std::vector<Node*>& lumps)
+{
+    std::stable_sort(lumps.begin(), lumps.end(),
+        [](const Node* a, const Node* b) { return a->offset < b->offset; });
+}
+
+int Wad::readAll(const std::string& dirPath, const LumpVisitor& visit)
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+    Node* dir = lookup(dirPath, guard, Expand::Children);
+    if (!dir || !dir->isDir)
+        return -1;
+
+    std::vector<Node*> lumps;
+    for (Node* child : dir->children)
+        if (!child->isDir)
+            lumps.push_back(child);
+    sortByOffset(lumps);
+    prefetch(lumps);
+
+    for (Node* n : lumps)
+        visit(std::string_view(n->name, n->nameLen), n->length ? bytes(n->offset) : nullptr,
+            n->length);
+    return lumps.size();
+}
+
+int Wad::readMany(const std::vector<std::string>& paths, const LumpReader& read)
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+
+    // Resolve everything first, keeping each lump's index into paths
+    std::vector<std::pair<Node*, size_t>> found;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        Node* n = lookup(paths[i], guard);
+        if (n && !n->isDir)
+            found.emplace_back(n, i);
+    }
+    std::stable_sort(found.begin(), found.end(),
+        [](const auto& a, const auto& b) { return a.first->offset < b.first->offset; });
+
+    std::vector<Node*> lumps;
+    lumps.reserve(found.size());
+    for (const auto& f : found)
+        lumps.push_back(f.first);
+    prefetch(lumps);
+
+    for (const auto& [n, i] : found)
+        read(i, n->length ? bytes(n->offset) : nullptr, n->length);
+    return found.size();
+}
+
+int Wad::walk(const std::string& path, bool recursive, EntryFn fn, void* ctx)
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+    Node* dir = lookup(path, guard, recursive ? Expand::Tree : Expand::Children);
+    if (!dir || !dir->isDir)
+        return -1;
+
+    int count = 0;
+    walkNode(dir, 0, recursive, fn, ctx, count);
+    return count;
+}
+
+int Wad::walk(int64_t handle, bool recursive, EntryFn fn, void* ctx)
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+    Node* dir = expandHandle(handle, guard, recursive ? Expand::Tree : Expand::Children);
+    if (!dir || !dir->isDir)
+        return -1;
+
+    int count = 0;
+    walkNode(dir, 0, recursive, fn, ctx, count);
+    return count;
+}
+
+void Wad::walkNode(const Node* dir, int depth, bool recursive, EntryFn fn, void* ctx, int& count)
+{
+    for (const Node* child : dir->children) {
+        fn(ctx, depth, std::string_view(child->name, child->nameLen), infoOf(child));
+        ++count;
+        if (recursive && child->isDir)
+            walkNode(child, depth + 1, recursive, fn, ctx, count);
+    }
+}
+
 int Wad::getDirectory(const std::string& path, std::vector<std::string>* directory)
 {
     if (!directory)
 	return -1;
+    std::shared_lock<std::shared_mutex> guard(lock);
     // Clear vector for safety
     directory->clear();
-    // Get node from path
-
-    std::string clean = norm(path);
-    if (clean.empty()) return -1;
-
-    Node* node = resolve(clean);
+    // Get node from path, with its children
+    Node* node = lookup(path, guard, Expand::Children);
     if (!node || !(node->isDir))
         return -1;
 
@@ -220,270 +694,902 @@ void Wad::createDirectory(const std::string& path)
     std::string parentPath = (slash == 0) ? "/" : cleaned.substr(0, slash);
     std::string dirName = cleaned.substr(slash + 1);
 
-    // Check if valid directory name
-    if (dirName.empty() || dirName.size() > 2)
-        return;
-
     std::string cleanParent = norm(parentPath);
     if (cleanParent.empty()) return;
 
     // Get parent node
-    Node* parent = resolve(cleanParent);
+    std::unique_lock<std::shared_mutex> guard(lock);
+    addDirectory(resolve(cleanParent), dirName);
+}
+
+void Wad::createFile(const std::string& path)
+{
+    // Split the path up
+    std::string cleaned = norm(path);
+    if (cleaned.empty() || cleaned == "/")
+	return;
+
+    int slash = cleaned.find_last_of('/');
+    std::string parentPath = (slash == 0) ? "/" : cleaned.substr(0, slash);
+    std::string fileName = cleaned.substr(slash + 1);
+
+    // Get parent node
+    std::unique_lock<std::shared_mutex> guard(lock);
+    addLump(resolve(parentPath), fileName);
+}
+
+int64_t Wad::createDirectory(int64_t parent, std::string_view name)
+{
+    std::unique_lock<std::shared_mutex> guard(lock);
+    Node* dir = addDirectory(fromHandle(parent), name);
+    return dir ? static_cast<int64_t>(dir->id) : -1;
+}
+
+int64_t Wad::createFile(int64_t parent, std::string_view name)
+{
+    std::unique_lock<std::shared_mutex> guard(lock);
+    Node* lump = addLump(fromHandle(parent), name);
+    return lump ? static_cast<int64_t>(lump->id) : -1;
+}
+
+Node* Wad::addDirectory(Node* parent, std::string_view dirName)
+{
+    // Check if valid directory name
+    if (dirName.empty() || dirName.size() > 2 || dirName.find('/') != std::string_view::npos)
+        return nullptr;
+
+    if (!parent || !parent->isDir)
+        return nullptr;
+    materialize(parent);
 
     // Make sure parent is not a Map Marker
-    if (parent->name.size() == 4 && parent->name[0] == 'E' && std::isdigit(parent->name[1])
-        && parent->name[2] == 'M' && std::isdigit(parent->name[3]))
-        return;
+    if (classifyName(parent->name, parent->nameLen) == Marker::Map)
+        return nullptr;
 
     // Check if directory already exists
-    for (Node* c : parent->children)
-        if (c->name == dirName)
-            return;
-
-    // Calculate where to insert descriptors
-    size_t insertPos;
-    if (parent == root) {
-        insertPos = descriptors.size();
-    } else {
-        // Find <PARENT>_END
-        std::string endTag = parent->name + "_END";
-        insertPos = parent->descIndex + 1;
-        while (insertPos < descriptors.size()) {
-            std::string name(descriptors[insertPos].name, strnlen(descriptors[insertPos].name, 8));
-            if (name == endTag)
-                break;
-            ++insertPos;
-        }
-        // Check to make sure <PARENT>_END exists
-        if (insertPos == descriptors.size())
-            return;
-    }
+    if (findChild(parent, dirName.data(), dirName.size()))
+        return nullptr;
+
+    // Namespaces insert before their <PARENT>_END, make sure it exists
+    if (parent != root && parent->end == descriptors.end())
+        return nullptr;
 
     // Create new descriptors
-    Descriptor startDesc { 0, 0 };
-    Descriptor endDesc { 0, 0 };
+    Descriptor startDesc { 0, 0, {} };
+    Descriptor endDesc { 0, 0, {} };
 
     // Add names to descriptors
-    std::string startTag = dirName + "_START";
-    std::string endTag = dirName + "_END";
-
-    memset(startDesc.name, 0, 8);
-    memset(endDesc.name, 0, 8);
+    std::string name(dirName);
+    strncpy(startDesc.name, (name + "_START").c_str(), 8);
+    strncpy(endDesc.name, (name + "_END").c_str(), 8);
 
-    strncpy(startDesc.name, (dirName + "_START").c_str(), 8);
-    strncpy(endDesc.name, (dirName + "_END").c_str(), 8);
-
-    // Insert descriptors into vector
-    descriptors.insert(descriptors.begin() + insertPos, { startDesc, endDesc });
+    // Insert descriptors into list
+    auto startIt = descriptors.insert(parent->end, startDesc);
+    auto endIt = descriptors.insert(parent->end, endDesc);
     // Update header
     header.count += 2;
 
-    // Adjust descIndex for every Node after insertPos
-    std::vector<Node*> stack { root };
-    while (!stack.empty()) {
-        Node* n = stack.back();
-        stack.pop_back();
-        if (n->descIndex >= insertPos)
-            n->descIndex += 2;
-        for (Node* ch : n->children)
-            stack.push_back(ch);
-    }
-
     // Create node and add it to directory tree
-    Node* dir = new Node { dirName, true, 0, 0, parent, {}, insertPos };
-    // Keep children in descriptor order
-    auto& vec = parent->children;
-    auto pos = vec.begin();
-    while (pos != vec.end() && (*pos)->descIndex < dir->descIndex)
-        ++pos;
-    vec.insert(pos, dir);
-
-    // Add into fileData
-    std::vector<char> raw(32);
-    memcpy(raw.data(), &startDesc, sizeof(Descriptor));
-    memcpy(raw.data() + 16, &endDesc, sizeof(Descriptor));
-    // Byte position in the descriptor table
-    size_t bytePos = header.offset + insertPos * sizeof(Descriptor);
-    // Splice the 32 bytes into the file image
-    fileData.insert(fileData.begin() + bytePos, raw.begin(), raw.end());
-
-    // Update header lump count inside the file image
-    std::memcpy(fileData.data() + 4, &header.count, sizeof(uint32_t));
-
-    return;
+    Node* dir = newNode(dirName.data(), dirName.size(), true, startIt);
+    dir->end = endIt;
+    // New descriptors land just before the parent's _END, so this keeps descriptor order
+    addChild(parent, dir);
+
+    // Table is rewritten at flush
+    tableDirty = true;
+    ++generation;
+    return dir;
 }
 
-void Wad::createFile(const std::string& path)
+Node* Wad::addLump(Node* parent, std::string_view fileName)
 {
-    // Split the path up
-    std::string cleaned = norm(path);
-    if (cleaned.empty() || cleaned == "/")
-	return;
-
-    int slash = cleaned.find_last_of('/');
-    std::string parentPath = (slash == 0) ? "/" : cleaned.substr(0, slash);
-    std::string fileName = cleaned.substr(slash + 1);
-
-    // Check if valid directory name
-    if (fileName.empty() || fileName.size() > 8)
-        return;
+    // Check if valid file name
+    if (fileName.empty() || fileName.size() > 8 || fileName.find('/') != std::string_view::npos)
+        return nullptr;
 
-    // Check if fileName is a Map Marker
-    if (fileName.size() == 4 && fileName[0] == 'E' && std::isdigit(fileName[1]) &&
-	fileName[2] == 'M' && std::isdigit(fileName[3]))
-    return;
+    // Lumps named like a marker would turn into directories on reload
+    if (classifyName(fileName.data(), fileName.size()) != Marker::Lump)
+        return nullptr;
 
-    // Get parent node
-    Node* parent = resolve(parentPath);
     if (!parent || !parent->isDir)
-        return;
+        return nullptr;
+    materialize(parent);
 
     // Make sure parent is not a Map Marker
-    if (parentPath.size() == 4 && parentPath[0] == 'E' && std::isdigit(parentPath[1])
-        && parentPath[2] == 'M' && std::isdigit(parentPath[3]))
-        return;
+    if (classifyName(parent->name, parent->nameLen) == Marker::Map)
+        return nullptr;
 
     // Check if file already exists
-    for (Node* c : parent->children)
-        if (c->name == fileName)
-            return;
-
-    // Calculate where to insert descriptors
-    size_t insertPos;
-    if (parent == root) {
-        insertPos = descriptors.size();
-    } else {
-        std::string endTag = parent->name + "_END";
-        insertPos = parent->descIndex + 1;
-        while (insertPos < descriptors.size()) {
-            std::string name(descriptors[insertPos].name, strnlen(descriptors[insertPos].name, 8));
-            if (name == endTag)
-                break;
-            ++insertPos;
-        }
-        if (insertPos == descriptors.size())
-            return;
-    }
+    if (findChild(parent, fileName.data(), fileName.size()))
+        return nullptr;
+
+    // Namespaces insert before their <PARENT>_END, make sure it exists
+    if (parent != root && parent->end == descriptors.end())
+        return nullptr;
 
     // Build new lump descriptor
-    Descriptor fileDesc { 0, 0 };
-    memset(fileDesc.name, 0, 8);
-    strncpy(fileDesc.name, fileName.c_str(), 8);
+    Descriptor fileDesc { 0, 0, {} };
+    memcpy(fileDesc.name, fileName.data(), fileName.size());
 
-    // Insert into descriptor vector and fix header count
-    descriptors.insert(descriptors.begin() + insertPos, fileDesc);
+    // Insert into descriptor list and fix header count
+    auto fileIt = descriptors.insert(parent->end, fileDesc);
     header.count += 1;
 
-    // Adjust descIndex
-    std::vector<Node*> stack { root };
-    while (!stack.empty()) {
-        Node* n = stack.back();
-        stack.pop_back();
-        if (n->descIndex >= insertPos)
-            n->descIndex += 1;
-        for (Node* ch : n->children)
-            stack.push_back(ch);
-    }
-
     // Create node and add to directory tree
-    Node* fileNode = new Node { fileName, false, 0, 0, parent, {}, insertPos };
-    // Keep children in order
-    auto& vec = parent->children;
-    auto it = vec.begin();
-    while (it != vec.end() && (*it)->descIndex < fileNode->descIndex)
-        ++it;
-    vec.insert(it, fileNode);
+    Node* fileNode = newNode(fileName.data(), fileName.size(), false, fileIt);
+    // Appending keeps children in descriptor order
+    addChild(parent, fileNode);
+
+    // Table is rewritten at flush
+    tableDirty = true;
+    ++generation;
+    return fileNode;
+}
 
-    // Add into fileData
-    std::vector<char> raw(16);
-    std::memcpy(raw.data(), &fileDesc, sizeof(Descriptor));
+int Wad::writeToFile(const std::string& path, const char* buffer, int length, int offset)
+{
+    std::unique_lock<std::shared_mutex> guard(lock);
+    return writeNode(resolve(path), buffer, length, offset);
+}
 
-    // Byte position in the descriptor table
-    size_t bytePos = header.offset + insertPos * sizeof(Descriptor);
-    // Add data to fileData
-    fileData.insert(fileData.begin() + bytePos, raw.begin(), raw.end());
+int Wad::writeLump(int64_t handle, const char* buffer, int length, int offset)
+{
+    std::unique_lock<std::shared_mutex> guard(lock);
+    return writeNode(fromHandle(handle), buffer, length, offset);
+}
 
-    // Write updated lump count into header
-    std::memcpy(fileData.data() + 4, &header.count, sizeof(uint32_t));
+int Wad::truncateFile(const std::string& path, uint32_t size)
+{
+    std::unique_lock<std::shared_mutex> guard(lock);
+    return truncateNode(resolve(path), size);
 }
 
-int Wad::writeToFile(const std::string& path, const char* buffer, int length, int offset)
+int Wad::truncateLump(int64_t handle, uint32_t size)
+{
+    std::unique_lock<std::shared_mutex> guard(lock);
+    return truncateNode(fromHandle(handle), size);
+}
+
+int Wad::writeNode(Node* node, const char* buffer, int length, int offset)
 {
     // Check validity
     if (!buffer || length <= 0 || offset < 0)
         return -1;
 
-    Node* node = resolve(path);
     // Make sure it's a lump
     if (!node || node->isDir)
         return -1;
 
-    // Lump has to be empty
-    if (node->length != 0)
+    // Lumps on disk are patched in place while the write stays inside their extent: one
+    // pwrite, which a mapping sees through the page cache, and the descriptor keeps its offset.
+    // Anything else, or a failed pwrite, moves the lump somewhere writable first.
+    uint64_t end = (uint64_t)offset + length;
+    bool inPlace = (uint64_t)node->offset + node->capacity <= flushedEnd && end <= node->capacity;
+    if (!inPlace || !store(node->offset + offset, buffer, length)) {
+        // Make the written range writable, gap before offset reads as zeros
+        if (!reserve(node, end) || !store(node->offset + offset, buffer, length))
+            return -1;
+    }
+
+    // Writes can overwrite or extend, never shrink
+    if (end > node->length)
+        node->length = end;
+
+    // Update descriptor
+    Descriptor& d = *node->desc;
+    if (d.offset != node->offset || d.length != node->length) {
+        d.offset = node->offset;
+        d.length = node->length;
+        tableDirty = true;
+    }
+
+    ++generation;
+    return length;
+}
+
+int Wad::truncateNode(Node* node, uint32_t size)
+{
+    if (!node || node->isDir)
         return -1;
 
-    // Calculate lump size and create lump data
-    uint32_t lumpSize = offset + length;
-    std::vector<char> lumpData(lumpSize, 0);
-    memcpy(lumpData.data() + offset, buffer, length);
+    if (size > node->length) {
+        // Grow with zeros
+        if (!reserve(node, size))
+            return -1;
+    } else if (node->offset >= flushedEnd && node->capacity > 0) {
+        // Bytes past the length must read as zeros if the lump grows again
+        memset(fileData.data() + (node->offset - fileBase) + size, 0, node->length - size);
+    } else {
+        // On disk: give the tail up, growing again relocates
+        if (node->capacity > size)
+            release(node->offset + size, node->capacity - size);
+        node->capacity = std::min(node->capacity, size);
+    }
 
-    // Insert lump before descriptor list
-    size_t insertPos = header.offset;
-    fileData.insert(fileData.begin() + insertPos, lumpData.begin(), lumpData.end());
+    node->length = size;
+    node->desc->offset = node->offset;
+    node->desc->length = size;
+    tableDirty = true;
+    ++generation;
+    return 0;
+}
 
-    // Update header
-    header.offset += lumpSize;
-    memcpy(fileData.data() + 8, &header.offset, sizeof(uint32_t));
+bool Wad::reserve(Node* node, uint64_t size)
+{
+    // Lumps written since the last flush live in fileData with room up to capacity
+    bool inMemory = node->capacity > 0 && node->offset >= flushedEnd;
+    if (inMemory && size <= node->capacity)
+        return true;
+
+    // Lump offsets are 32-bit
+    if (size > UINT32_MAX)
+        return false;
+
+    // The last lump grows in place, so streaming one file never copies
+    if (inMemory && node->offset + node->capacity == dataEnd) {
+        if (node->offset + size > UINT32_MAX)
+            return false;
+        dataEnd = node->offset + size;
+        fileData.resize(dataEnd - fileBase);
+        node->capacity = size;
+        return true;
+    }
 
-    // Update descriptor
-    Descriptor& d = descriptors[node->descIndex];
-    d.offset = static_cast<uint32_t>(insertPos);
-    d.length = lumpSize;
-    node->offset = d.offset;
-    node->length = d.length;
-    size_t descByte = header.offset + node->descIndex * sizeof(Descriptor);
-    std::memcpy(fileData.data() + descByte, &d, sizeof(Descriptor));
+    // Otherwise move with slack, doubling keeps repeated growth of interleaved lumps linear
+    size = std::max<uint64_t>(size, node->length);
+    uint64_t capacity = std::max<uint64_t>(size, (uint64_t)node->length * 2);
 
-    return length;
+    // Holes in the file come first, best fit keeps large holes whole. The move goes
+    // straight to disk, slack included since in-place writes rely on it reading as zeros.
+    uint32_t start;
+    for (uint64_t want : { capacity, size }) {
+        if (want > UINT32_MAX || !freeSpace.take(want, start))
+            continue;
+        std::vector<char> moved(want, 0);
+        if (node->length > 0)
+            memcpy(moved.data(), bytes(node->offset), node->length);
+        if (store(start, moved.data(), want)) {
+            if (node->capacity > 0)
+                release(node->offset, node->capacity);
+            node->offset = start;
+            node->capacity = want;
+            return true;
+        }
+        freeSpace.add(start, want);
+        break;
+    }
+
+    // Then the end of the data
+    if (dataEnd + capacity > UINT32_MAX)
+        capacity = size;
+    if (dataEnd + capacity > UINT32_MAX)
+        return false;
+
+    start = dataEnd;
+    dataEnd += capacity;
+    fileData.resize(dataEnd - fileBase);
+    if (node->length > 0)
+        memcpy(fileData.data() + (start - fileBase), bytes(node->offset), node->length);
+
+    if (node->capacity > 0)
+        release(node->offset, node->capacity);
+    node->offset = start;
+    node->capacity = capacity;
+    tailNode = node;
+    return true;
 }
 
-Node* Wad::resolve(const std::string& path)
+bool Wad::store(uint32_t offset, const char* data, size_t length)
 {
-    // Path validity check
-    if (path.empty() || path[0] != '/')
-        return nullptr;
+    // Flushed ranges go to disk now, the rest waits for flush in fileData
+    if (offset < flushedEnd && !writeAll(fd, data, length, offset))
+        return false;
+    if (offset >= fileBase)
+        memcpy(fileData.data() + (offset - fileBase), data, length);
+    return true;
+}
 
-    // Check if root
-    if (path == "/")
-        return root;
+void Wad::release(uint32_t offset, uint32_t length)
+{
+    if (length > 0)
+        released.emplace_back(offset, length);
+}
 
-    Node* cur = root;
-    std::size_t pos = 1; // Skip leading '/'
-    while (pos < path.size()) {
-        std::size_t next = path.find('/', pos);
-        std::string part = path.substr(pos, next - pos);
-        if (part.empty()) {
-            pos = (next == std::string::npos) ? path.size() : next + 1;
+void Wad::scanExtents(std::vector<std::pair<uint32_t, uint32_t>>& used)
+{
+    // Lumps are usually stored in table order
+    if (!std::is_sorted(used.begin(), used.end()))
+        std::sort(used.begin(), used.end());
+
+    // Walk runs of overlapping extents, the header is the first one
+    uint64_t runStart = 0, runEnd = sizeof(Header);
+    bool shared = false;
+    for (const auto& [offset, length] : used) {
+        if (offset < runEnd) {
+            shared = true;
+            runEnd = std::max<uint64_t>(runEnd, (uint64_t)offset + length);
+            continue;
+        }
+        if (shared)
+            sharedExtents.emplace_back(runStart, runEnd);
+        if (offset > runEnd)
+            freeSpace.add(runEnd, offset - runEnd);
+        runStart = offset;
+        runEnd = (uint64_t)offset + length;
+        shared = false;
+    }
+    if (shared)
+        sharedExtents.emplace_back(runStart, runEnd);
+    if (dataEnd > runEnd)
+        freeSpace.add(runEnd, dataEnd - runEnd);
+}
+
+bool Wad::sharedData(uint32_t offset, uint32_t length) const
+{
+    // First shared run ending after offset
+    auto it = std::upper_bound(sharedExtents.begin(), sharedExtents.end(), (uint64_t)offset,
+        [](uint64_t pos, const std::pair<uint64_t, uint64_t>& run) { return pos < run.second; });
+    return it != sharedExtents.end() && it->first < (uint64_t)offset + length;
+}
+
+int Wad::flush()
+{
+    std::unique_lock<std::shared_mutex> guard(lock);
+    if (stale) {
+        errno = ESTALE;
+        return -1;
+    }
+
+    // Appending a lump always dirties the table, so this covers everything
+    if (!tableDirty)
+        return 0;
+    if (fd < 0)
+        return -1;
+
+    // Slack behind the last lump is not worth writing
+    if (tailNode && tailNode->offset + tailNode->capacity == dataEnd) {
+        dataEnd = tailNode->offset + tailNode->length;
+        tailNode->capacity = tailNode->length;
+        fileData.resize(dataEnd - fileBase);
+    }
+    tailNode = nullptr;
+
+    // So is free space there, the file shrinks to the table behind the remaining data
+    uint32_t freeStart;
+    bool shrink = freeSpace.takeEndingAt(dataEnd, freeStart);
+    if (shrink) {
+        dataEnd = freeStart;
+        flushedEnd = std::min(flushedEnd, dataEnd);
+        if (dataEnd < fileBase) {
+            fileBase = dataEnd;
+            std::vector<char>().swap(fileData);
+        } else {
+            fileData.resize(dataEnd - fileBase);
+        }
+    }
+
+    // Lumps appended since the last flush
+    if (flushedEnd < dataEnd && !writeAll(fd, bytes(flushedEnd), dataEnd - flushedEnd, flushedEnd))
+        return -1;
+
+    // The new table goes into free space or after the data, never over the table the header
+    // on disk still points at
+    std::vector<Descriptor> table(descriptors.begin(), descriptors.end());
+    size_t newTableBytes = table.size() * sizeof(Descriptor);
+    uint32_t tableStart;
+    bool inHole = newTableBytes > 0 && freeSpace.take(newTableBytes, tableStart);
+    if (!inHole) {
+        if (dataEnd + newTableBytes > UINT32_MAX)
+            return -1;
+        tableStart = dataEnd;
+    }
+    Header next = header;
+    next.count = table.size();
+    next.offset = tableStart;
+
+    // Header last, so a failure before it leaves the old header and table in charge
+    if (!writeAll(fd, reinterpret_cast<const char*>(table.data()), newTableBytes, tableStart)
+        || !writeAll(fd, reinterpret_cast<const char*>(&next), sizeof(Header), 0)) {
+        if (inHole)
+            freeSpace.add(tableStart, newTableBytes);
+        return -1;
+    }
+
+    // The new table is used space like lump data, the old one is free from now on
+    release(header.offset, tableBytes);
+    header = next;
+    tableBytes = newTableBytes;
+    if (!inHole) {
+        dataEnd += newTableBytes;
+        fileData.resize(dataEnd - fileBase);
+    }
+    if (tableStart >= fileBase)
+        memcpy(fileData.data() + (tableStart - fileBase), table.data(), newTableBytes);
+
+    if (shrink && ftruncate(fd, dataEnd) < 0)
+        return -1;
+
+    flushedEnd = dataEnd;
+    tableDirty = false;
+
+    // The new table no longer references extents given up since the last flush, but a
+    // located read may still be on its way out of one. Those wait for a later flush.
+    if (located == 0) {
+        for (const auto& [offset, length] : released)
+            freeSpace.add(offset, length);
+        released.clear();
+    }
+
+    // Serve the flushed lumps from the mapping again
+    if (mapBase && !fileData.empty())
+        remap();
+
+    return 0;
+}
+
+int Wad::sync()
+{
+    if (flush() < 0)
+        return -1;
+    // fd never changes after load, no lock needed
+    return (fdatasync(fd) < 0) ? -1 : 0;
+}
+
+int Wad::compact()
+{
+    // One at a time, they would share the temporary file
+    std::lock_guard<std::mutex> single(compacting);
+    if (fd < 0)
+        return -1;
+    if (stale) {
+        errno = ESTALE;
+        return -1;
+    }
+
+    // Going back to the shared lock. Linux drops a flock before converting it, so another
+    // Wad may have compacted the file in between, and this one is left on the old file.
+    auto relock = [&]() {
+        int err = errno;
+        struct stat opened;
+        flock(fd, LOCK_SH);
+        if (fstat(fd, &opened) == 0 && renamedOver(path, opened))
+            stale = true;
+        errno = err;
+    };
+
+    // Other processes with the file loaded would keep writing to the old one after the
+    // rename, so it has to be ours alone (EWOULDBLOCK otherwise)
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        relock();
+        return -1;
+    }
+
+    // Build the new file beside the old one, which stays untouched until the rename.
+    // Loaders wait on its lock until it has replaced the old file.
+    struct stat st;
+    std::string tempPath = path + ".compact";
+    int out = -1;
+    auto discard = [&]() {
+        if (out >= 0) {
+            close(out);
+            unlink(tempPath.c_str());
+            out = -1;
+        }
+    };
+    auto fail = [&]() {
+        int err = errno;
+        discard();
+        errno = err;
+        relock();
+        return -1;
+    };
+    if (fstat(fd, &st) < 0)
+        return fail();
+    // Renaming over a newer file would throw its data away
+    if (renamedOver(path, st)) {
+        stale = true;
+        errno = ESTALE;
+        return fail();
+    }
+
+    // The copy is made while readers and writers carry on and only swapped in if nothing
+    // was written meanwhile. A busy WAD gets a few tries before giving up with EAGAIN.
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        out = open(tempPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, st.st_mode & 07777);
+        if (out < 0 || flock(out, LOCK_EX) < 0)
+            return fail();
+
+        std::vector<Descriptor> table;
+        std::vector<char> image;
+        Header compacted;
+        uint64_t seen;
+        {
+            std::shared_lock<std::shared_mutex> guard(lock);
+            seen = generation;
+            if (!writeCompacted(out, table, image, compacted))
+                return fail();
+        }
+        size_t newTableBytes = table.size() * sizeof(Descriptor);
+        uint32_t end = compacted.offset + newTableBytes;
+        if (!writeAll(out, reinterpret_cast<const char*>(&compacted), sizeof(Header), 0)
+            || fsync(out) < 0)
+            return fail();
+
+        // Map the new file before committing to it
+        void* base = nullptr;
+        if (mapBase) {
+            base = mmap(nullptr, end, PROT_READ, MAP_SHARED, out, 0);
+            if (base == MAP_FAILED)
+                return fail();
+        }
+
+        // Positions from locateLump are in the old layout, the swap waits for those reads.
+        // None start meanwhile, readers are sent to readLump.
+        std::unique_lock<std::shared_mutex> guard(lock);
+        draining = true;
+        unlocated.wait(guard, [&]() { return located == 0; });
+        draining = false;
+        if (generation != seen || rename(tempPath.c_str(), path.c_str()) < 0) {
+            bool changed = generation != seen;
+            guard.unlock();
+            if (base)
+                munmap(base, end);
+            if (!changed)
+                return fail();
+            discard();
+            continue;
+        }
+
+        // Same descriptor number on the new file, callers may keep the fd from locateLump.
+        // The lock comes along and goes back to shared for this Wad.
+        dup2(out, fd);
+        close(out);
+        relock();
+
+        // Everything is on disk now
+        auto d = descriptors.begin();
+        for (const Descriptor& moved : table)
+            *d++ = moved;
+        header = compacted;
+        tableBytes = newTableBytes;
+        dataEnd = flushedEnd = end;
+        tableDirty = false;
+        tailNode = nullptr;
+        if (mapBase) {
+            munmap(mapBase, mapSize);
+            mapBase = base;
+            mapSize = end;
+            fileBase = end;
+            std::vector<char>().swap(fileData);
+        } else {
+            fileData.swap(image);
+            fileBase = 0;
+        }
+
+        // No free space left, but shared data is still shared
+        freeSpace = FreeExtents();
+        released.clear();
+        sharedExtents.clear();
+        std::vector<std::pair<uint32_t, uint32_t>> used;
+        for (const Descriptor& moved : table)
+            if (moved.length > 0)
+                used.emplace_back(moved.offset, moved.length);
+        used.emplace_back(compacted.offset, newTableBytes);
+        scanExtents(used);
+
+        for (Node* n : nodesById) {
+            if (!n || n->desc == descriptors.end())
+                continue;
+            n->offset = n->desc->offset;
+            n->capacity = (n->length > 0 && sharedData(n->offset, n->length)) ? 0 : n->length;
+        }
+        guard.unlock();
+
+        // Make the rename durable
+        size_t slash = path.find_last_of('/');
+        std::string dir = (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+        int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dirFd >= 0) {
+            fsync(dirFd);
+            close(dirFd);
+        }
+        return 0;
+    }
+
+    errno = EAGAIN;
+    return fail();
+}
+
+bool Wad::writeCompacted(int out, std::vector<Descriptor>& table, std::vector<char>& image,
+    Header& compacted) const
+{
+    // Lump data in table order, so each namespace is one run. Descriptors that pointed at
+    // the same bytes still do, markers point at the current position like in the original.
+    // Mapped WADs go out in chunks, buffered ones keep the whole image as the new fileData.
+    const size_t chunk = 1 << 20;
+    table.assign(descriptors.begin(), descriptors.end());
+    std::unordered_map<uint64_t, uint32_t> placed;
+    image.assign(sizeof(Header), 0);
+    uint64_t imageBase = 0;
+    for (Descriptor& d : table) {
+        if (d.length == 0) {
+            d.offset = imageBase + image.size();
+            continue;
+        }
+        uint64_t key = (uint64_t)d.offset << 32 | d.length;
+        auto [it, fresh] = placed.try_emplace(key, imageBase + image.size());
+        if (fresh) {
+            const char* data = bytes(d.offset);
+            image.insert(image.end(), data, data + d.length);
+        }
+        d.offset = it->second;
+
+        if (mapBase && image.size() >= chunk) {
+            if (!writeAll(out, image.data(), image.size(), imageBase))
+                return false;
+            imageBase += image.size();
+            image.clear();
+        }
+    }
+
+    // Table after the data, the header is written last by the caller
+    compacted = header;
+    compacted.count = table.size();
+    compacted.offset = imageBase + image.size();
+    const char* tableData = reinterpret_cast<const char*>(table.data());
+    image.insert(image.end(), tableData, tableData + table.size() * sizeof(Descriptor));
+    if (imageBase == 0)
+        memcpy(image.data(), &compacted, sizeof(Header));
+    return writeAll(out, image.data(), image.size(), imageBase);
+}
+
+const char* Wad::bytes(size_t offset) const
+{
+    if (offset < fileBase)
+        return static_cast<const char*>(mapBase) + offset;
+    return fileData.data() + (offset - fileBase);
+}
+
+void Wad::prefetch(const std::vector<Node*>& lumps) const
+{
+    if (!mapBase)
+        return;
+
+    // Start readahead on mapped lumps, merging neighbours so scattered sets of small lumps
+    // do not cost one call each
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t maxGap = 64 * 1024;
+    size_t start = 0, end = 0;
+    auto advise = [&]() {
+        if (end > start) {
+            size_t aligned = start & ~(page - 1);
+            madvise(static_cast<char*>(mapBase) + aligned, end - aligned, MADV_WILLNEED);
+        }
+    };
+
+    for (const Node* n : lumps) {
+        if (n->length == 0 || n->offset >= fileBase)
+            continue;
+        size_t lo = n->offset;
+        size_t hi = std::min<size_t>(lo + n->length, fileBase);
+        if (end > start && lo <= end + maxGap) {
+            end = std::max(end, hi);
             continue;
         }
+        advise();
+        start = lo;
+        end = hi;
+    }
+    advise();
+}
+
+void Wad::remap()
+{
+    // The table is inside the data
+    size_t size = dataEnd;
+    void* base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    // Keep serving appended lumps from fileData if the file cannot be mapped
+    if (base == MAP_FAILED)
+        return;
+
+    munmap(mapBase, mapSize);
+    mapBase = base;
+    mapSize = size;
+    fileBase = dataEnd;
+    std::vector<char>().swap(fileData);
+}
+
+Node* Wad::newNode(const char* name, size_t len, bool isDir, DescList::iterator desc)
+{
+    // Offset and length mirror the descriptor, root has none
+    uint32_t offset = (desc != descriptors.end()) ? desc->offset : 0;
+    uint32_t length = (desc != descriptors.end()) ? desc->length : 0;
+    // Data shared with other descriptors is not the lump's to overwrite or give up
+    uint32_t capacity = (length > 0 && sharedData(offset, length)) ? 0 : length;
+
+    void* mem = arena.allocate(sizeof(Node), alignof(Node));
+    Node* n = new (mem) Node { {}, static_cast<uint8_t>(len), isDir, offset, length, capacity,
+        static_cast<uint32_t>(nodesById.size()), nullptr, std::pmr::vector<Node*>(&arena), true,
+        std::pmr::vector<PendingChild>(&arena), desc, descriptors.end() };
+    memcpy(n->name, name, len);
+    nodesById.push_back(n);
+    return n;
+}
+
+EntryInfo Wad::infoOf(const Node* node)
+{
+    if (node->isDir) {
+        // Lazy directories know their child count before materializing
+        size_t children = node->loaded ? node->children.size() : node->pending.size();
+        return EntryInfo { EntryKind::Directory, static_cast<uint32_t>(children), 0, node->id };
+    }
+    return EntryInfo { EntryKind::Content, node->length, node->offset, node->id };
+}
 
-        // Search in child vector
-        bool found = false;
-        for (Node* ch : cur->children) {
-            if (ch->name == part) {
-                cur = ch;
-                found = true;
-                break;
+Node* Wad::fromHandle(int64_t handle) const
+{
+    // Handles are node ids, slot 0 is never used
+    if (handle <= 0 || (uint64_t)handle >= nodesById.size())
+        return nullptr;
+    return nodesById[handle];
+}
+
+Node* Wad::findChild(const Node* parent, const char* name, size_t len)
+{
+    uint64_t packed;
+    if (!packName(name, len, packed))
+        return nullptr;
+
+    auto it = childIndex.find(ChildKey { parent, packed });
+    return (it == childIndex.end()) ? nullptr : it->second;
+}
+
+void Wad::addChild(Node* parent, Node* child)
+{
+    child->parent = parent;
+    parent->children.push_back(child);
+
+    // First entry wins on duplicate names, matching a front-to-back scan
+    uint64_t packed;
+    if (packName(child->name, child->nameLen, packed))
+        childIndex.emplace(ChildKey { parent, packed }, child);
+}
+
+Node* Wad::resolve(const std::string& path, bool* complete)
+{
+    if (complete)
+        *complete = true;
+
+    // Path validity check
+    if (path.empty() || path[0] != '/')
+        return nullptr;
+
+    // Walk components in place, one hash lookup per level
+    Node* cur = root;
+    const char* p = path.data();
+    const char* end = p + path.size();
+    while (p < end) {
+        // Skip separators
+        while (p < end && *p == '/')
+            ++p;
+        if (p == end)
+            break;
+
+        const char* next = p;
+        while (next < end && *next != '/')
+            ++next;
+
+        // Children of a lazy directory only exist once it is materialized
+        if (!cur->loaded) {
+            if (complete) {
+                *complete = false;
+                return nullptr;
             }
+            materialize(cur);
         }
-        if (!found)
-            return nullptr;
 
-        // Advance to next component
-        if (next == std::string::npos)
-            break; // Last token
-        pos = next + 1;
+        cur = findChild(cur, p, next - p);
+        if (!cur)
+            return nullptr;
+        p = next;
     }
 
     return cur;
 }
+
+Node* Wad::lookup(const std::string& path, std::shared_lock<std::shared_mutex>& guard,
+    Expand expand)
+{
+    bool complete;
+    Node* node = resolve(path, &complete);
+    if (complete && (!node || expanded(node, expand)))
+        return node;
+
+    // Materializing changes the tree, so do it exclusively. Loaded directories never
+    // unload, so the shared retry below finds everything in place.
+    guard.unlock();
+    {
+        std::unique_lock<std::shared_mutex> writer(lock);
+        node = resolve(path);
+        if (node)
+            this->expand(node, expand);
+    }
+    guard.lock();
+    return resolve(path, &complete);
+}
+
+void Wad::materialize(Node* dir)
+{
+    if (dir->loaded)
+        return;
+
+    dir->children.reserve(dir->pending.size());
+    for (const PendingChild& c : dir->pending) {
+        Node* child = c.dir;
+        if (!child)
+            child = newNode(c.desc->name, strnlen(c.desc->name, 8), false, c.desc);
+        addChild(dir, child);
+    }
+
+    // Arena memory, nothing to free
+    dir->pending = std::pmr::vector<PendingChild>(&arena);
+    dir->loaded = true;
+}
+
+void Wad::setLoadThreads(unsigned threads)
+{
+    loadThreads = threads;
+}
+
+Node* Wad::expandHandle(int64_t handle, std::shared_lock<std::shared_mutex>& guard,
+    Expand expand)
+{
+    Node* node = fromHandle(handle);
+    if (!node || expanded(node, expand))
+        return node;
+
+    // Same upgrade as lookup(), the node itself already exists
+    guard.unlock();
+    {
+        std::unique_lock<std::shared_mutex> writer(lock);
+        this->expand(node, expand);
+    }
+    guard.lock();
+    return node;
+}
+
+bool Wad::expanded(const Node* node, Expand expand)
+{
+    if (expand == Expand::None)
+        return true;
+    if (!node->loaded)
+        return false;
+    if (expand == Expand::Tree)
+        for (const Node* child : node->children)
+            if (child->isDir && !expanded(child, expand))
+                return false;
+    return true;
+}
+
+void Wad::expand(Node* node, Expand expand)
+{
+    if (expand == Expand::None)
+        return;
+    materialize(node);
+    if (expand == Expand::Tree)
+        for (Node* child : node->children)
+            if (child->isDir)
+                this->expand(child, expand);
+}
+
+void Wad::attach(Node* parent, Node* dir, DescList::iterator marker)
+{
+    // Lazy parents link their directories in order when materialized
+    if (parent->loaded) {
+        addChild(parent, dir);
+    } else {
+        dir->loaded = false;
+        dir->parent = parent;
+        parent->pending.push_back(PendingChild { marker, dir });
+    }
+}
@@ -1,7 +1,19 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 // WAD file header
@@ -18,47 +30,300 @@ struct Descriptor {
     char name[8];
 };
 
-// Directory node
+// Descriptors in file order. List nodes never move, so iterators are stable handles
+// and inserting before a cached position is O(1).
+using DescList = std::pmr::list<Descriptor>;
+
+struct Node;
+
+// Child recorded by a lazy load but not turned into a Node yet
+struct PendingChild {
+    DescList::iterator desc; // Lump or marker descriptor
+    Node* dir; // Directory node already created for a marker, nullptr for lumps
+};
+
+// Directory node, allocated from the owning Wad's arena
 struct Node {
-    std::string name; // File/Directory name
+    char name[9]; // File/Directory name, inline since WAD names are at most 8 chars
+    uint8_t nameLen; // Length of name
     bool isDir; // Directory indicator
     uint32_t offset; // Lump offset in bytes
     uint32_t length; // Lump size
+    uint32_t capacity; // Bytes reserved at offset, the lump can grow in place up to this
+    uint32_t id; // Stable index into Wad::nodesById, root is 1
 
     // Tree structure
     Node* parent; // Parent node
-    std::vector<Node*> children; // Child nodes
+    std::pmr::vector<Node*> children; // Child nodes, storage also from the arena
+    bool loaded; // Children are materialized (always true outside TreeMode::Lazy)
+    std::pmr::vector<PendingChild> pending; // Children still to materialize, in order
+
+    DescList::iterator desc; // Matching descriptor (marker for directories)
+    DescList::iterator end; // Namespace _END marker, new children are inserted before it
+};
+
+// Key for child lookup: parent node plus child name packed into 8 bytes
+struct ChildKey {
+    const Node* parent;
+    uint64_t name;
+
+    bool operator==(const ChildKey& other) const
+    {
+        return parent == other.parent && name == other.name;
+    }
+};
+
+struct ChildKeyHash {
+    size_t operator()(const ChildKey& k) const
+    {
+        uint64_t h = reinterpret_cast<uintptr_t>(k.parent) * 0x9E3779B97F4A7C15ull;
+        return h ^ (k.name + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2));
+    }
+};
+
+// Unused byte ranges of the WAD file, coalesced, with a best-fit index by size
+class FreeExtents
+{
+public:
+    void add(uint32_t offset, uint32_t length); // Merges with adjacent extents
+    bool take(uint32_t length, uint32_t& offset); // Front of the smallest extent that fits
+    bool takeEndingAt(uint64_t end, uint32_t& offset); // Whole extent ending at end, if any
+    uint64_t total() const { return bytes; } // Free bytes
+
+private:
+    std::map<uint32_t, uint32_t> byOffset; // offset -> length
+    std::set<std::pair<uint32_t, uint32_t>> bySize; // (length, offset)
+    uint64_t bytes = 0;
+};
+
+// What a path refers to
+enum class EntryKind {
+    Missing, // Nothing at path
+    Directory, // Namespace, map or root
+    Content // Lump
+};
+
+// Everything callers usually need about a path, from a single lookup
+struct EntryInfo {
+    EntryKind kind;
+    uint32_t size; // Lump size, or number of children for directories
+    uint32_t offset; // Lump offset in the file
+    int64_t handle; // Entry handle for the handle calls, -1 if missing
+};
+
+// How loadWad brings the file into memory
+enum class LoadMode {
+    Buffered, // Read the whole file into fileData
+    Mmap // Map the file read-only and serve lump bytes from the mapping
+};
 
-    size_t descIndex; // Index of matching descriptor
+// How much of the directory tree loadWad builds up front
+enum class TreeMode {
+    Eager, // Whole tree at load
+    Lazy // Only directories at load, a directory's children on its first lookup
 };
 
+// Batched read callbacks get pointers into the WAD image, valid only during the call. The
+// Wad stays read-locked meanwhile, so callbacks must not call back into it.
+using LumpVisitor = std::function<void(std::string_view name, const char* data, uint32_t size)>;
+using LumpReader = std::function<void(size_t index, const char* data, uint32_t size)>;
+
+// Public calls are safe from any thread: readers share the lock, writers hold it exclusively
 class Wad
 {
 public:
     ~Wad(); // Destructor
-    static Wad* loadWad(const std::string& path); // Dynamically create a WAD object
+    // Dynamically create a WAD object
+    static Wad* loadWad(const std::string& path, LoadMode mode = LoadMode::Buffered,
+        TreeMode tree = TreeMode::Eager);
+    // Threads used to parse large descriptor tables in later loads, 0 (default) uses one per core
+    static void setLoadThreads(unsigned threads);
     std::string getMagic(); // Get magic data
     bool isContent(const std::string& path); // Checks if path represents data
     bool isDirectory(const std::string& path); // Checks if path represents a directory
     int getSize(const std::string& path); // Returns size of content if content
+    EntryInfo stat(const std::string& path); // Kind, size and offset of path in one resolve
 
     // Copy lump data into buffer, returns bytes copied
     int getContents(const std::string& path, char* buffer, int length, int offset = 0);
+    // Lump handle for repeated I/O without path lookups, returns -1 if path is not a lump.
+    // Handles stay valid for the Wad's lifetime.
+    int64_t openLump(const std::string& path);
+    // Same as getContents/writeToFile on an open handle
+    int readLump(int64_t handle, char* buffer, int length, int offset = 0);
+    int writeLump(int64_t handle, const char* buffer, int length, int offset = 0);
+    // Locate lump bytes in the WAD file for zero-copy reads. Returns the byte count readLump
+    // would copy, or -1. *fd is -1 when those bytes are not on disk yet and readLump is needed.
+    // Otherwise they stay at *filePos until releaseLocated() is called after reading them.
+    int locateLump(int64_t handle, int length, int offset, int* fd, uint64_t* filePos);
+    void releaseLocated(); // Done with a range locateLump gave an fd for
+
+    // Batched zero-copy reads in file order, both return the number of lumps visited.
+    // readAll visits the lumps directly in a directory (-1 if it is not one), readMany the
+    // given paths by index, skipping any that are not lumps.
+    int readAll(const std::string& dirPath, const LumpVisitor& visit);
+    int readMany(const std::vector<std::string>& paths, const LumpReader& read);
+
+    // Visit a directory's children in order as visit(std::string_view name, const EntryInfo&),
+    // without allocating. Names are NUL terminated. Returns the child count, or -1 if path
+    // is not a directory. Same rules as batched read callbacks.
+    template <typename Visitor>
+    int visitDirectory(const std::string& path, Visitor&& visit);
+    // Visit everything below a directory depth first as visit(int depth, name, info), depth 0
+    // being its children. Returns the number of entries visited, or -1.
+    template <typename Visitor>
+    int walkTree(const std::string& path, Visitor&& visit);
+
     // Fill vector with immediate children of directory, returns count
     int getDirectory(const std::string& path, std::vector<std::string>* directory);
 
     void createDirectory(const std::string& path); // Create a new namespace directory at path
     void createFile(const std::string& path); // Create an empty lump (file) at path
 
-    // Write buffer to lump, returns bytes written
+    // Write buffer to lump at any offset, overwriting or extending it, returns bytes written
     int writeToFile(const std::string& path, const char* buffer, int length, int offset = 0);
+    // Shrink or zero-extend a lump, returns 0 or -1
+    int truncateFile(const std::string& path, uint32_t size);
+
+    // Handle calls for inode-style frontends. Every entry keeps one handle for the Wad's
+    // lifetime and the root's is 1. Lump handles also work with readLump and friends.
+    EntryInfo stat(int64_t handle);
+    EntryInfo lookupChild(int64_t dir, std::string_view name); // One child of a directory
+    template <typename Visitor>
+    int visitDirectory(int64_t dir, Visitor&& visit);
+    // Create a namespace or empty lump in a directory, returns its handle or -1
+    int64_t createDirectory(int64_t parent, std::string_view name);
+    int64_t createFile(int64_t parent, std::string_view name);
+    int truncateLump(int64_t handle, uint32_t size); // truncateFile on a lump handle
+
+    int flush(); // Write changed regions back to the file, returns 0 or -1
+    int sync(); // flush() and then force the data to stable storage, returns 0 or -1
+    // Rewrite the file with lump data in table order and no gaps, then swap it in with an
+    // atomic rename. Handles stay valid. The swap waits for located ranges to be released,
+    // positions located before it mean nothing afterwards. Returns 0 or -1, errno being
+    // EWOULDBLOCK if another Wad has the file loaded, EAGAIN if writes kept interfering and
+    // ESTALE if another Wad's compaction already replaced the file.
+    int compact();
 
 private:
+    std::mutex compacting; // Held by compact() from start to finish
+    // Ranges handed out by locateLump and not released yet, extents given up meanwhile are
+    // neither reused nor cut off the file
+    std::atomic<uint32_t> located { 0 };
+    std::atomic<bool> draining { false }; // compact() waits for located to drop to 0
+    std::condition_variable_any unlocated; // Wakes compact() once it has
+    // Another Wad's compaction replaced the file under this one, flush fails with ESTALE
+    std::atomic<bool> stale { false };
+    mutable std::shared_mutex lock; // Guards everything below
+
     Header header; // File header
-    std::vector<char> fileData; // Raw data from file
-    std::vector<Descriptor> descriptors; // Hold descriptors in order
+    std::vector<char> fileData; // Image bytes from fileBase up to dataEnd
 
-    Node* resolve(const std::string& path); // Convert path to a Node pointer
+    std::string path; // WAD file path, compact() replaces the file there
+    int fd = -1; // Open WAD file, used for write-back
+    void* mapBase = nullptr; // Mapped file region (Mmap mode)
+    size_t mapSize = 0; // Length of mapped region
+    size_t fileBase = 0; // Image bytes below this come from the mapping
+    uint32_t dataEnd = 0; // End of lumps and table, lumps that fit no free extent go here
+    uint32_t flushedEnd = 0; // Lump data up to here is on disk
+    bool tableDirty = false; // Descriptor table or header needs rewriting
+    uint32_t tableBytes = 0; // Table at header.offset on disk, freed once flush replaces it
+    Node* tailNode = nullptr; // Lump whose slack ends at dataEnd, trimmed at flush
+    uint64_t generation = 0; // Bumped by every change to lumps or the table, compact() checks it
 
-    Node* root; // Pointer to root directory node
+    // Space left by moved and shrunk lumps. Extents given up since the last flush are still
+    // referenced by the table on disk and only become free once flush has replaced it.
+    FreeExtents freeSpace;
+    std::vector<std::pair<uint32_t, uint32_t>> released; // (offset, length)
+    // Runs of lump data referenced by more than one descriptor, never moved or freed
+    std::vector<std::pair<uint64_t, uint64_t>> sharedExtents; // [start, end), sorted
+
+    // (parent, name) -> child, so each path component is one hash lookup
+    std::unordered_map<ChildKey, Node*, ChildKeyHash> childIndex;
+
+    // Bump allocator for Nodes, their child arrays and descriptors, released all at once
+    std::pmr::monotonic_buffer_resource arena;
+    DescList descriptors { &arena }; // Hold descriptors in order
+    std::pmr::vector<Node*> nodesById { 1, nullptr, &arena }; // Node ids, slot 0 unused
+
+    // Create a node in the arena
+    Node* newNode(const char* name, size_t len, bool isDir, DescList::iterator desc);
+    // Convert path to a Node pointer, materializing lazy directories on the way. With
+    // complete set it changes nothing and reports false if it would have to materialize.
+    Node* resolve(const std::string& path, bool* complete = nullptr);
+    // How much of a lazy tree below a looked-up node has to exist
+    enum class Expand { None, Children, Tree };
+    // resolve() for readers holding the shared lock, briefly upgrading when the tree must grow
+    Node* lookup(const std::string& path, std::shared_lock<std::shared_mutex>& guard,
+        Expand expand = Expand::None);
+    // lookup() for a handle, the node exists but its children may not
+    Node* expandHandle(int64_t handle, std::shared_lock<std::shared_mutex>& guard, Expand expand);
+    void materialize(Node* dir); // Turn a lazy directory's pending children into Nodes
+    static bool expanded(const Node* node, Expand expand); // Nothing left to materialize
+    void expand(Node* node, Expand expand); // Materialize as much as expanded() checks
+    void attach(Node* parent, Node* dir, DescList::iterator marker); // Link or queue a loaded directory
+    Node* fromHandle(int64_t handle) const; // Node for a lump handle, or nullptr
+    static EntryInfo infoOf(const Node* node); // What stat() reports for a node
+    // Type-erased visitor behind visitDirectory and walkTree
+    using EntryFn = void (*)(void* ctx, int depth, std::string_view name, const EntryInfo& info);
+    int walk(const std::string& path, bool recursive, EntryFn fn, void* ctx);
+    int walk(int64_t handle, bool recursive, EntryFn fn, void* ctx);
+    void walkNode(const Node* dir, int depth, bool recursive, EntryFn fn, void* ctx, int& count);
+    int readNode(Node* node, char* buffer, int length, int offset); // getContents on a node
+    int writeNode(Node* node, const char* buffer, int length, int offset); // writeToFile on a node
+    int truncateNode(Node* node, uint32_t size); // truncateFile on a node
+    Node* addDirectory(Node* parent, std::string_view name); // createDirectory under a node
+    Node* addLump(Node* parent, std::string_view name); // createFile under a node
+    bool reserve(Node* node, uint64_t size); // Make lump bytes [0, size) writable
+    bool store(uint32_t offset, const char* data, size_t length); // Write image bytes at offset
+    void release(uint32_t offset, uint32_t length); // Free an extent after the next flush
+    // Free space from the gaps between used extents, which are sorted here
+    void scanExtents(std::vector<std::pair<uint32_t, uint32_t>>& used);
+    bool sharedData(uint32_t offset, uint32_t length) const; // Overlaps another lump's data
+    Node* findChild(const Node* parent, const char* name, size_t len); // Hash lookup of one child
+    void addChild(Node* parent, Node* child); // Append child and index it
+    const char* bytes(size_t offset) const; // Pointer to image byte at offset
+    void prefetch(const std::vector<Node*>& lumps) const; // Read ahead mapped lumps, in offset order
+    void remap(); // Map the flushed file again and drop fileData
+    // compact()'s new image in out, all but the header, under the shared lock
+    bool writeCompacted(int out, std::vector<Descriptor>& table, std::vector<char>& image,
+        Header& compacted) const;
+
+    Node* root = nullptr; // Pointer to root directory node
 };
+
+template <typename Visitor>
+int Wad::visitDirectory(const std::string& path, Visitor&& visit)
+{
+    using Target = std::remove_reference_t<Visitor>;
+    return walk(
+        path, false,
+        [](void* ctx, int, std::string_view name, const EntryInfo& info) {
+            (*static_cast<Target*>(ctx))(name, info);
+        },
+        const_cast<void*>(static_cast<const void*>(&visit)));
+}
+
+template <typename Visitor>
+int Wad::visitDirectory(int64_t dir, Visitor&& visit)
+{
+    using Target = std::remove_reference_t<Visitor>;
+    return walk(
+        dir, false,
+        [](void* ctx, int, std::string_view name, const EntryInfo& info) {
+            (*static_cast<Target*>(ctx))(name, info);
+        },
+        const_cast<void*>(static_cast<const void*>(&visit)));
+}
+
+template <typename Visitor>
+int Wad::walkTree(const std::string& path, Visitor&& visit)
+{
+    using Target = std::remove_reference_t<Visitor>;
+    return walk(
+        path, true,
+        [](void* ctx, int depth, std::string_view name, const EntryInfo& info) {
+            (*static_cast<Target*>(ctx))(depth, name, info);
+        },
+        const_cast<void*>(static_cast<const void*>(&visit)));
+}
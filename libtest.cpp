@@ -7,12 +7,18 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <csignal>
 #include <cstring>
+#include <cerrno>
 #include <ctype.h>
 #include <algorithm>
 #include <cctype>
 #include <stack>
 #include <regex>
+#include <thread>
+#include <atomic>
+#include <chrono>
 #include "gtest/gtest.h"
 
 #include "libWad/Wad.h"
@@ -125,6 +131,30 @@ TEST(LibReadTests, getSize){
         delete testWad;
 }
 
+TEST(LibReadTests, statTest){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path);
+
+        //Testing valid content
+        EntryInfo info = testWad->stat("/Gl/ad/os/cake.jpg");
+        ASSERT_EQ(info.kind, EntryKind::Content);
+        ASSERT_EQ(info.size, 29869);
+        ASSERT_EQ(info.offset, 150);
+
+        //Testing valid directories, their size is the child count
+        ASSERT_EQ(testWad->stat("/E1M0").kind, EntryKind::Directory);
+        ASSERT_EQ(testWad->stat("/E1M0").size, 10);
+        ASSERT_EQ(testWad->stat("/Gl/ad/").kind, EntryKind::Directory);
+        ASSERT_EQ(testWad->stat("/").kind, EntryKind::Directory);
+
+        //Testing nonexistent paths
+        ASSERT_EQ(testWad->stat("/E1M1").kind, EntryKind::Missing);
+        ASSERT_EQ(testWad->stat("/Gl/ad/os/cake.jpg/x").kind, EntryKind::Missing);
+        ASSERT_EQ(testWad->stat("").kind, EntryKind::Missing);
+
+        delete testWad;
+}
+
 TEST(LibReadTests, getContentsTest1){
         std::string wad_path = setupWorkspace();
         Wad* testWad = Wad::loadWad(wad_path);
@@ -283,6 +313,151 @@ TEST(LibReadTests, getContentsTest8){
 }
 
 
+TEST(LibReadTests, getContentsTest9){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path, LoadMode::Mmap);
+        ASSERT_NE(testWad, nullptr);
+
+        //getContents Test 9, reading large image file from a mapped WAD
+        std::string testPath = "/Gl/ad/os/cake.jpg";
+        ASSERT_EQ(testWad->getMagic(), "IWAD");
+        ASSERT_TRUE(testWad->isDirectory("/Gl/ad/os"));
+        int size = testWad->getSize(testPath);
+        ASSERT_EQ(size, 29869);
+
+        char* expectedContents = new char[30000];
+        char* buffer = new char[30000];
+
+        int file_fd = open("./testfiles/cake.jpg", O_RDONLY, 0777);
+        read(file_fd, expectedContents, size);
+        close(file_fd);
+
+        int ret = testWad->getContents(testPath, buffer, 29869);
+        ASSERT_EQ(ret, 29869);
+        ASSERT_EQ(memcmp(expectedContents, buffer, 29869), 0);
+
+        delete[] expectedContents;
+        delete[] buffer;
+        delete testWad;
+}
+
+
+TEST(LibReadTests, openLumpTest){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path);
+
+        //Reading a lump in chunks through a handle
+        int64_t handle = testWad->openLump("/mp.txt");
+        ASSERT_GT(handle, 0);
+
+        char expected[398];
+        char buffer[398];
+        ASSERT_EQ(testWad->getContents("/mp.txt", expected, 398), 398);
+        for (int offset = 0; offset < 398; offset += 64) {
+                int ret = testWad->readLump(handle, buffer + offset, 64, offset);
+                ASSERT_EQ(ret, std::min(64, 398 - offset));
+        }
+        ASSERT_EQ(memcmp(expected, buffer, 398), 0);
+        ASSERT_EQ(testWad->readLump(handle, buffer, 64, 398), 0);
+
+        //Directories, missing paths and bad handles
+        ASSERT_EQ(testWad->openLump("/Gl/ad"), -1);
+        ASSERT_EQ(testWad->openLump("/notreal"), -1);
+        ASSERT_EQ(testWad->readLump(0, buffer, 64), -1);
+        ASSERT_EQ(testWad->readLump(100000, buffer, 64), -1);
+
+        //Writing through a handle to a new file
+        testWad->createFile("/file.txt");
+        handle = testWad->openLump("/file.txt");
+        ASSERT_GT(handle, 0);
+        ASSERT_EQ(testWad->writeLump(handle, "abc", 3), 3);
+        ASSERT_EQ(testWad->getSize("/file.txt"), 3);
+
+        delete testWad;
+}
+
+TEST(LibReadTests, locateLumpTest){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path, LoadMode::Mmap);
+
+        //Lump bytes on disk can be read straight from the WAD file
+        int64_t handle = testWad->openLump("/mp.txt");
+        int fd = -1;
+        uint64_t pos = 0;
+        int ret = testWad->locateLump(handle, 17, 117, &fd, &pos);
+        ASSERT_EQ(ret, 17);
+        ASSERT_GE(fd, 0);
+
+        char buffer[100];
+        memset(buffer, 0, 100);
+        ASSERT_EQ(pread(fd, buffer, ret, pos), 17);
+        ASSERT_EQ(memcmp(buffer, "airspeed velocity", 17), 0);
+        testWad->releaseLocated();
+
+        //Unflushed lumps are only in memory until flush
+        testWad->createFile("/file.txt");
+        handle = testWad->openLump("/file.txt");
+        ASSERT_EQ(testWad->writeLump(handle, "abc", 3), 3);
+        ASSERT_EQ(testWad->locateLump(handle, 100, 0, &fd, &pos), 3);
+        ASSERT_EQ(fd, -1);
+        ASSERT_EQ(testWad->flush(), 0);
+        ASSERT_EQ(testWad->locateLump(handle, 100, 0, &fd, &pos), 3);
+        ASSERT_GE(fd, 0);
+        testWad->releaseLocated();
+
+        delete testWad;
+}
+
+TEST(LibReadTests, readAllTest){
+        std::string wad_path = setupWorkspace();
+
+        for (LoadMode mode : { LoadMode::Buffered, LoadMode::Mmap }) {
+                Wad* testWad = Wad::loadWad(wad_path, mode);
+
+                //readAll visits every lump of a directory with the same bytes as getContents
+                std::vector<std::pair<std::string, std::string>> lumps;
+                int ret = testWad->readAll("/E1M0", [&](std::string_view name, const char* data, uint32_t size) {
+                        lumps.emplace_back(std::string(name), std::string(data, size));
+                });
+                ASSERT_EQ(ret, 10);
+                ASSERT_EQ(lumps.size(), 10);
+                for (auto& [name, data] : lumps) {
+                        std::string path = "/E1M0/" + name;
+                        std::vector<char> expected(data.size() + 1);
+                        ASSERT_EQ(testWad->getContents(path, expected.data(), expected.size()), (int)data.size());
+                        ASSERT_EQ(memcmp(data.data(), expected.data(), data.size()), 0);
+                }
+
+                //Subdirectories are not lumps, files are not directories
+                ASSERT_EQ(testWad->readAll("/", [&](std::string_view name, const char*, uint32_t) {
+                        ASSERT_EQ(name, "mp.txt");
+                }), 1);
+                ASSERT_EQ(testWad->readAll("/mp.txt", [](std::string_view, const char*, uint32_t) {}), -1);
+
+                delete testWad;
+        }
+}
+
+TEST(LibReadTests, readManyTest){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path, LoadMode::Mmap);
+
+        //readMany reports each lump by its index, skipping paths that are not lumps
+        std::vector<std::string> paths = { "/mp.txt", "/Gl/ad/os/cake.jpg", "/Gl", "/missing", "/E1M0/01.txt", "/mp.txt" };
+        std::vector<std::string> contents(paths.size());
+        int ret = testWad->readMany(paths, [&](size_t index, const char* data, uint32_t size) {
+                contents[index].assign(data, size);
+        });
+        ASSERT_EQ(ret, 4);
+        ASSERT_EQ(contents[1].size(), 29869);
+        ASSERT_TRUE(contents[2].empty());
+        ASSERT_TRUE(contents[3].empty());
+        ASSERT_EQ(contents[4], "He loves to sing\n");
+        ASSERT_EQ(contents[0], contents[5]);
+        ASSERT_EQ(contents[0].size(), testWad->getSize("/mp.txt"));
+
+        delete testWad;
+}
 
 TEST(LibReadTests, getDirectoryTest1){
         std::string wad_path = setupWorkspace();
@@ -406,6 +581,159 @@ TEST(LibReadTests, getDirectoryTest6){
         delete testWad;
 }
 
+TEST(LibReadTests, lazyTreeTest){
+        std::string wad_path = setupWorkspace();
+        Wad* eagerWad = Wad::loadWad(wad_path);
+        Wad* lazyWad = Wad::loadWad(wad_path, LoadMode::Buffered, TreeMode::Lazy);
+        ASSERT_NE(lazyWad, nullptr);
+
+        //lazyTreeTest, deep lookup first, then every directory listing matches the eager tree
+        ASSERT_EQ(lazyWad->getSize("/Gl/ad/os/cake.jpg"), 29869);
+        ASSERT_TRUE(lazyWad->isDirectory("/E1M0"));
+        ASSERT_FALSE(lazyWad->isContent("/Gl/ad/missing"));
+
+        std::stack<std::string> dirs;
+        dirs.push("/");
+        while(!dirs.empty()){
+                std::string dir = dirs.top();
+                dirs.pop();
+
+                std::vector<std::string> expectedVector;
+                std::vector<std::string> testVector;
+                ASSERT_EQ(lazyWad->getDirectory(dir, &testVector), eagerWad->getDirectory(dir, &expectedVector));
+                ASSERT_EQ(testVector, expectedVector);
+
+                for(const std::string& name : expectedVector){
+                        std::string child = dir + name;
+                        ASSERT_EQ(lazyWad->isDirectory(child), eagerWad->isDirectory(child));
+                        ASSERT_EQ(lazyWad->getSize(child), eagerWad->getSize(child));
+                        if(eagerWad->isDirectory(child)){
+                                dirs.push(child + "/");
+                        }
+                }
+        }
+        delete eagerWad;
+
+        //Writes into a directory that was never listed
+        lazyWad->createFile("/Gl/ad/new");
+        ASSERT_EQ(lazyWad->writeToFile("/Gl/ad/new", "lazy", 4), 4);
+        delete lazyWad;
+
+        lazyWad = Wad::loadWad(wad_path, LoadMode::Buffered, TreeMode::Lazy);
+        char buffer[4];
+        ASSERT_EQ(lazyWad->getContents("/Gl/ad/new", buffer, 4), 4);
+        ASSERT_EQ(memcmp(buffer, "lazy", 4), 0);
+
+        delete lazyWad;
+}
+
+TEST(LibReadTests, visitDirectoryTest){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path);
+
+        //visitDirectory sees the same children as getDirectory, with their kind and size
+        std::vector<std::string> expectedVector;
+        std::vector<std::string> testVector;
+        std::vector<EntryInfo> infos;
+        int ret = testWad->visitDirectory("/", [&](std::string_view name, const EntryInfo& info) {
+                testVector.push_back(std::string(name));
+                infos.push_back(info);
+        });
+        ASSERT_EQ(ret, 3);
+        ASSERT_EQ(testWad->getDirectory("/", &expectedVector), 3);
+        ASSERT_EQ(testVector, expectedVector);
+        ASSERT_EQ(infos[0].kind, EntryKind::Directory);
+        ASSERT_EQ(infos[0].size, 10);
+        ASSERT_EQ(infos[2].kind, EntryKind::Content);
+        ASSERT_EQ(infos[2].size, testWad->getSize("/mp.txt"));
+        ASSERT_EQ(infos[2].handle, testWad->openLump("/mp.txt"));
+
+        //Only directories can be visited
+        auto ignore = [](std::string_view, const EntryInfo&) {};
+        ASSERT_EQ(testWad->visitDirectory("/mp.txt", ignore), -1);
+        ASSERT_EQ(testWad->visitDirectory("/missing", ignore), -1);
+
+        delete testWad;
+}
+
+TEST(LibReadTests, walkTreeTest){
+        std::string wad_path = setupWorkspace();
+
+        for (TreeMode tree : { TreeMode::Eager, TreeMode::Lazy }) {
+                Wad* testWad = Wad::loadWad(wad_path, LoadMode::Buffered, tree);
+
+                //walkTree visits every entry depth first with its depth
+                std::vector<std::string> testVector;
+                int ret = testWad->walkTree("/Gl", [&](int depth, std::string_view name, const EntryInfo&) {
+                        testVector.push_back(std::to_string(depth) + std::string(name));
+                });
+                std::vector<std::string> expectedVector = { "0ad", "1os", "2cake.jpg" };
+                ASSERT_EQ(ret, 3);
+                ASSERT_EQ(testVector, expectedVector);
+
+                //The whole tree: 3 at the root, 10 map lumps, 3 below Gl
+                ASSERT_EQ(testWad->walkTree("/", [](int, std::string_view, const EntryInfo&) {}), 16);
+
+                delete testWad;
+        }
+}
+
+TEST(LibReadTests, handleTest){
+        std::string wad_path = setupWorkspace();
+
+        for (TreeMode tree : { TreeMode::Eager, TreeMode::Lazy }) {
+                Wad* testWad = Wad::loadWad(wad_path, LoadMode::Buffered, tree);
+
+                //The root is handle 1, children are found one component at a time
+                EntryInfo root = testWad->stat(1);
+                ASSERT_EQ(root.kind, EntryKind::Directory);
+                ASSERT_EQ(root.handle, 1);
+                ASSERT_EQ(root.size, 3);
+
+                EntryInfo gl = testWad->lookupChild(1, "Gl");
+                EntryInfo ad = testWad->lookupChild(gl.handle, "ad");
+                EntryInfo os = testWad->lookupChild(ad.handle, "os");
+                EntryInfo cake = testWad->lookupChild(os.handle, "cake.jpg");
+                ASSERT_EQ(cake.kind, EntryKind::Content);
+                ASSERT_EQ(cake.size, 29869);
+                ASSERT_EQ(cake.handle, testWad->openLump("/Gl/ad/os/cake.jpg"));
+                ASSERT_EQ(testWad->stat(cake.handle).offset, cake.offset);
+
+                //Misses and bad handles
+                ASSERT_EQ(testWad->lookupChild(1, "nothing").kind, EntryKind::Missing);
+                ASSERT_EQ(testWad->lookupChild(cake.handle, "x").kind, EntryKind::Missing);
+                ASSERT_EQ(testWad->stat(0).kind, EntryKind::Missing);
+                ASSERT_EQ(testWad->stat(1 << 30).kind, EntryKind::Missing);
+
+                //Listing by handle matches listing by path
+                std::vector<std::string> expectedVector;
+                std::vector<std::string> testVector;
+                ASSERT_EQ(testWad->visitDirectory(testWad->lookupChild(1, "E1M0").handle,
+                        [&](std::string_view name, const EntryInfo&) { testVector.push_back(std::string(name)); }), 10);
+                testWad->getDirectory("/E1M0", &expectedVector);
+                ASSERT_EQ(testVector, expectedVector);
+
+                //Creating by handle
+                int64_t dir = testWad->createDirectory(ad.handle, "ex");
+                ASSERT_GT(dir, 1);
+                ASSERT_EQ(testWad->createDirectory(ad.handle, "ex"), -1);
+                ASSERT_EQ(testWad->createDirectory(cake.handle, "ex"), -1);
+                int64_t file = testWad->createFile(dir, "new.txt");
+                ASSERT_GT(file, dir);
+                ASSERT_EQ(testWad->createFile(dir, "new.txt"), -1);
+                ASSERT_EQ(testWad->createFile(dir, "toolongname"), -1);
+                ASSERT_TRUE(testWad->isContent("/Gl/ad/ex/new.txt"));
+
+                ASSERT_EQ(testWad->writeLump(file, "abcdef", 6), 6);
+                ASSERT_EQ(testWad->truncateLump(file, 2), 0);
+                ASSERT_EQ(testWad->stat(file).size, 2);
+                ASSERT_EQ(testWad->truncateLump(dir, 2), -1);
+
+                delete testWad;
+                setupWorkspace();
+        }
+}
+
 TEST(LibWriteTests, createDirectoryTest1){
         std::string wad_path = setupWorkspace();
         Wad* testWad = Wad::loadWad(wad_path);
@@ -925,6 +1253,34 @@ TEST(LibWriteTests, createFileTest6){
         delete testWad;
 }
 
+TEST(LibWriteTests, createFileTest7){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path);
+
+        //createFile Test 7, passing names that would read back as namespace markers
+        testWad->createFile("/Gl/ab_START");
+        testWad->createFile("/Gl/ab_END");
+        testWad->createFile("/Gl/_END");
+
+        ASSERT_FALSE(testWad->isContent("/Gl/ab_START"));
+        ASSERT_FALSE(testWad->isContent("/Gl/ab_END"));
+        ASSERT_FALSE(testWad->isContent("/Gl/_END"));
+
+        //Names that only contain the marker text are still lumps
+        testWad->createFile("/Gl/_STARTx");
+        ASSERT_TRUE(testWad->isContent("/Gl/_STARTx"));
+
+        delete testWad;
+
+        testWad = Wad::loadWad(wad_path);
+        std::vector<std::string> testVector;
+        ASSERT_EQ(testWad->getDirectory("/Gl", &testVector), 2);
+        ASSERT_TRUE(testWad->isDirectory("/Gl/ad"));
+        ASSERT_TRUE(testWad->isContent("/Gl/_STARTx"));
+
+        delete testWad;
+}
+
 TEST(LibWriteTests, writeToFileTest1){
         std::string wad_path = setupWorkspace();
         Wad* testWad = Wad::loadWad(wad_path);
@@ -982,13 +1338,9 @@ TEST(LibWriteTests, writeToFileTest1){
         << "Expected string: " << buffer
         << "Returned string: " << expectedFileContents;
 
-        //Attemping to write to the file again
-
+        //Writing to the file again overwrites it in place
         ret = testWad->writeToFile(testPath, expectedFileContents, expectedSizeOfFile);
-        //path is technically valid, but the file already exists.
-        //function should return 0, to signify that the path is valid
-        //but the the write should still fail.
-        ASSERT_EQ(ret, 0);
+        ASSERT_EQ(ret, expectedSizeOfFile);
         ASSERT_EQ(testWad->getSize(testPath), expectedSizeOfFile);
 
         memset(buffer, 0, 100);
@@ -1005,12 +1357,19 @@ TEST(LibWriteTests, writeToFileTest2){
         std::string wad_path = setupWorkspace();
         Wad* testWad = Wad::loadWad(wad_path);
 
-        //writeToFile Test 2, writing to an existing file
+        //writeToFile Test 2, overwriting the start of an existing file
         std::string testPath = "/E1M0/01.txt";
         const char testWriteContent[] = "Example text"; 
         int sizeOfWrite = sizeof(testWriteContent);
         int ret = testWad->writeToFile(testPath, testWriteContent, sizeOfWrite);
-        ASSERT_EQ(ret, 0);
+        ASSERT_EQ(ret, sizeOfWrite);
+        ASSERT_EQ(testWad->getSize(testPath), 17);
+
+        char buffer[100];
+        memset(buffer, 0, 100);
+        ASSERT_EQ(testWad->getContents(testPath, buffer, 17), 17);
+        ASSERT_EQ(memcmp(buffer, testWriteContent, sizeOfWrite), 0);
+        ASSERT_EQ(memcmp(buffer + sizeOfWrite, "ing\n", 4), 0);
         
         delete testWad;      
 }
@@ -1029,6 +1388,462 @@ TEST(LibWriteTests, writeToFileTest3){
         delete testWad;      
 }
 
+TEST(LibWriteTests, writeToFileTest4){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path, LoadMode::Mmap);
+
+        //writeToFile Test 4, appending several lumps to a mapped WAD
+        const char testWriteContent[] = "Example text";
+        int sizeOfWrite = sizeof(testWriteContent);
+        std::vector<std::string> paths = {"/a.txt", "/Gl/b.txt", "/Gl/ad/os/c.txt"};
+        for (const std::string& path : paths) {
+                testWad->createFile(path);
+                ASSERT_EQ(testWad->writeToFile(path, testWriteContent, sizeOfWrite), sizeOfWrite);
+        }
+        ASSERT_EQ(testWad->flush(), 0);
+
+        //Existing lumps still read correctly after the table moved
+        char buffer[100];
+        memset(buffer, 0, 100);
+        ASSERT_EQ(testWad->getContents("/E1M0/01.txt", buffer, 17), 17);
+        ASSERT_EQ(memcmp(buffer, "He loves to sing\n", 17), 0);
+
+        //Deleting and reinitiating object
+        delete testWad;
+        testWad = Wad::loadWad(wad_path);
+
+        for (const std::string& path : paths) {
+                memset(buffer, 0, 100);
+                ASSERT_EQ(testWad->getContents(path, buffer, sizeOfWrite), sizeOfWrite);
+                ASSERT_EQ(memcmp(buffer, testWriteContent, sizeOfWrite), 0);
+        }
+        ASSERT_EQ(testWad->getSize("/Gl/ad/os/cake.jpg"), 29869);
+
+        delete testWad;
+}
+
+TEST(LibWriteTests, writeToFileTest5){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path);
+
+        //writeToFile Test 5, streaming two files in interleaved chunks
+        int fd = open("./testfiles/cat.jpg", O_RDONLY);
+        struct stat st;
+        fstat(fd, &st);
+        int size = st.st_size;
+        std::vector<char> expected(size);
+        ASSERT_EQ(read(fd, expected.data(), size), size);
+        close(fd);
+
+        testWad->createFile("/cat.jpg");
+        testWad->createFile("/Gl/cat.jpg");
+        int chunk = 4096;
+        for (int offset = 0; offset < size; offset += chunk) {
+                int n = std::min(chunk, size - offset);
+                ASSERT_EQ(testWad->writeToFile("/cat.jpg", expected.data() + offset, n, offset), n);
+                ASSERT_EQ(testWad->writeToFile("/Gl/cat.jpg", expected.data() + offset, n, offset), n);
+        }
+
+        //Extending past the end leaves a zero gap
+        ASSERT_EQ(testWad->writeToFile("/mp.txt", "!", 1, 400), 1);
+        ASSERT_EQ(testWad->getSize("/mp.txt"), 401);
+
+        //Shrinking and growing again reads back zeros
+        ASSERT_EQ(testWad->truncateFile("/E1M0/01.txt", 3), 0);
+        ASSERT_EQ(testWad->truncateFile("/E1M0/01.txt", 6), 0);
+
+        //Deleting and reinitiating object
+        delete testWad;
+        testWad = Wad::loadWad(wad_path);
+
+        std::vector<char> buffer(size);
+        for (std::string path : {"/cat.jpg", "/Gl/cat.jpg"}) {
+                ASSERT_EQ(testWad->getSize(path), size);
+                ASSERT_EQ(testWad->getContents(path, buffer.data(), size), size);
+                ASSERT_EQ(memcmp(buffer.data(), expected.data(), size), 0);
+        }
+
+        char small[401];
+        ASSERT_EQ(testWad->getContents("/mp.txt", small, 401), 401);
+        ASSERT_EQ(small[398], 0);
+        ASSERT_EQ(small[399], 0);
+        ASSERT_EQ(small[400], '!');
+
+        ASSERT_EQ(testWad->getContents("/E1M0/01.txt", small, 100), 6);
+        ASSERT_EQ(memcmp(small, "He \0\0\0", 6), 0);
+
+        delete testWad;
+}
+
+TEST(LibWriteTests, writeToFileTest6){
+        for (LoadMode mode : {LoadMode::Buffered, LoadMode::Mmap}) {
+                std::string wad_path = setupWorkspace();
+                Wad* testWad = Wad::loadWad(wad_path, mode);
+
+                //writeToFile Test 6, overwriting inside a lump on disk keeps its extent
+                struct stat before;
+                ASSERT_EQ(stat(wad_path.c_str(), &before), 0);
+                EntryInfo info = testWad->stat("/E1M0/01.txt");
+                ASSERT_EQ(testWad->writeToFile("/E1M0/01.txt", "Jo", 2, 0), 2);
+                ASSERT_EQ(testWad->stat("/E1M0/01.txt").offset, info.offset);
+                ASSERT_EQ(testWad->getSize("/E1M0/01.txt"), info.size);
+
+                char buffer[100];
+                ASSERT_EQ(testWad->getContents("/E1M0/01.txt", buffer, 2), 2);
+                ASSERT_EQ(memcmp(buffer, "Jo", 2), 0);
+
+                //The bytes are already on disk before any flush
+                int fd = open(wad_path.c_str(), O_RDONLY);
+                ASSERT_EQ(pread(fd, buffer, 2, info.offset), 2);
+                close(fd);
+                ASSERT_EQ(memcmp(buffer, "Jo", 2), 0);
+
+                //Nothing is appended on flush
+                ASSERT_EQ(testWad->flush(), 0);
+                struct stat after;
+                ASSERT_EQ(stat(wad_path.c_str(), &after), 0);
+                ASSERT_EQ(after.st_size, before.st_size);
+
+                delete testWad;
+                testWad = Wad::loadWad(wad_path);
+                ASSERT_EQ(testWad->getContents("/E1M0/01.txt", buffer, 100), (int)info.size);
+                ASSERT_EQ(memcmp(buffer, "Jo loves to sing\n", 17), 0);
+                delete testWad;
+        }
+}
+
+TEST(LibWriteTests, freeSpaceTest1){
+        for (LoadMode mode : {LoadMode::Buffered, LoadMode::Mmap}) {
+                std::string wad_path = setupWorkspace();
+                Wad* testWad = Wad::loadWad(wad_path, mode);
+
+                //freeSpace Test 1, space left by a moved lump is reused after flush
+                std::vector<char> first(4000, 'a'), second(3000, 'b');
+                testWad->createFile("/fs1.txt");
+                ASSERT_EQ(testWad->writeToFile("/fs1.txt", first.data(), 4000), 4000);
+                ASSERT_EQ(testWad->flush(), 0);
+                uint32_t hole = testWad->stat("/fs1.txt").offset;
+
+                //Growing past its extent moves the lump
+                ASSERT_EQ(testWad->writeToFile("/fs1.txt", first.data(), 4000, 4000), 4000);
+                ASSERT_NE(testWad->stat("/fs1.txt").offset, hole);
+                ASSERT_EQ(testWad->flush(), 0);
+                struct stat before;
+                ASSERT_EQ(stat(wad_path.c_str(), &before), 0);
+
+                testWad->createFile("/fs2.txt");
+                ASSERT_EQ(testWad->writeToFile("/fs2.txt", second.data(), 3000), 3000);
+                //It lands in the freed extent, which may have merged with the old table
+                ASSERT_LE(testWad->stat("/fs2.txt").offset + 3000, hole + 4000);
+                ASSERT_EQ(testWad->flush(), 0);
+
+                //At most the new descriptor is added, the table itself may move into a hole
+                struct stat after;
+                ASSERT_EQ(stat(wad_path.c_str(), &after), 0);
+                ASSERT_LE(after.st_size, before.st_size + (off_t)sizeof(Descriptor));
+
+                delete testWad;
+                testWad = Wad::loadWad(wad_path);
+                std::vector<char> buffer(8000);
+                ASSERT_EQ(testWad->getContents("/fs1.txt", buffer.data(), 8000), 8000);
+                ASSERT_EQ(std::count(buffer.begin(), buffer.end(), 'a'), 8000);
+                ASSERT_EQ(testWad->getContents("/fs2.txt", buffer.data(), 8000), 3000);
+                ASSERT_EQ(std::count(buffer.begin(), buffer.begin() + 3000, 'b'), 3000);
+                ASSERT_EQ(testWad->getContents("/E1M0/01.txt", buffer.data(), 17), 17);
+                ASSERT_EQ(memcmp(buffer.data(), "He loves to sing\n", 17), 0);
+                delete testWad;
+        }
+}
+
+TEST(LibWriteTests, freeSpaceTest2){
+        for (LoadMode mode : {LoadMode::Buffered, LoadMode::Mmap}) {
+                std::string wad_path = setupWorkspace();
+                Wad* testWad = Wad::loadWad(wad_path, mode);
+                struct stat st;
+                ASSERT_EQ(stat(wad_path.c_str(), &st), 0);
+                off_t initial = st.st_size;
+
+                //freeSpace Test 2, rewriting lumps at changing sizes does not grow the file forever
+                testWad->createFile("/ch1.txt");
+                testWad->createFile("/ch2.txt");
+                std::vector<char> data(5000);
+                for (int i = 0; i < 100; i++) {
+                        int size = 1000 + (i * 797) % 4000;
+                        memset(data.data(), 'a' + i % 26, size);
+                        for (std::string path : {"/ch1.txt", "/ch2.txt"}) {
+                                ASSERT_EQ(testWad->truncateFile(path, 0), 0);
+                                ASSERT_EQ(testWad->writeToFile(path, data.data(), size), size);
+                        }
+                        ASSERT_EQ(testWad->flush(), 0);
+                }
+                ASSERT_EQ(stat(wad_path.c_str(), &st), 0);
+                ASSERT_LT(st.st_size, initial + 4 * 5000);
+
+                delete testWad;
+                testWad = Wad::loadWad(wad_path);
+                int size = 1000 + (99 * 797) % 4000;
+                std::vector<char> buffer(5000);
+                for (std::string path : {"/ch1.txt", "/ch2.txt"}) {
+                        ASSERT_EQ(testWad->getContents(path, buffer.data(), 5000), size);
+                        ASSERT_EQ(std::count(buffer.begin(), buffer.begin() + size, 'a' + 99 % 26), size);
+                }
+                delete testWad;
+        }
+}
+
+TEST(LibWriteTests, freeSpaceTest3){
+        //freeSpace Test 3, lumps sharing data stay independent
+        const std::string wad_path = "./testfiles/shared.wad";
+        Descriptor table[2] = { { sizeof(Header), 8, {'O', 'N', 'E'} }, { sizeof(Header), 8, {'T', 'W', 'O'} } };
+        Header header { {'P', 'W', 'A', 'D'}, 2, sizeof(Header) + 8 };
+        FILE* f = fopen(wad_path.c_str(), "wb");
+        fwrite(&header, sizeof(header), 1, f);
+        fwrite("original", 8, 1, f);
+        fwrite(table, sizeof(Descriptor), 2, f);
+        fclose(f);
+
+        Wad* testWad = Wad::loadWad(wad_path);
+        ASSERT_EQ(testWad->writeToFile("/ONE", "changed!", 8), 8);
+        ASSERT_EQ(testWad->truncateFile("/TWO", 4), 0);
+        ASSERT_EQ(testWad->flush(), 0);
+        delete testWad;
+
+        testWad = Wad::loadWad(wad_path);
+        char buffer[8];
+        ASSERT_EQ(testWad->getContents("/ONE", buffer, 8), 8);
+        ASSERT_EQ(memcmp(buffer, "changed!", 8), 0);
+        ASSERT_EQ(testWad->getContents("/TWO", buffer, 8), 4);
+        ASSERT_EQ(memcmp(buffer, "orig", 4), 0);
+        delete testWad;
+        unlink(wad_path.c_str());
+}
+
+TEST(LibWriteTests, freeSpaceTest4){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path, LoadMode::Mmap);
+
+        //freeSpace Test 4, a located range keeps its bytes until released
+        testWad->createFile("/x");
+        ASSERT_EQ(testWad->writeToFile("/x", "LOCATED-LUMP-DATA", 17), 17);
+        ASSERT_EQ(testWad->sync(), 0);
+        int fd = -1;
+        uint64_t pos = 0;
+        ASSERT_EQ(testWad->locateLump(testWad->openLump("/x"), 17, 0, &fd, &pos), 17);
+        ASSERT_GE(fd, 0);
+
+        //Growing moves the lump, another one of the same size would fit its old extent
+        std::vector<char> data(40, 'g');
+        ASSERT_EQ(testWad->writeToFile("/x", data.data(), 40, 17), 40);
+        ASSERT_EQ(testWad->sync(), 0);
+        testWad->createFile("/z");
+        ASSERT_EQ(testWad->writeToFile("/z", "SECRET-OTHER-LUMP", 17), 17);
+        ASSERT_EQ(testWad->sync(), 0);
+
+        char buffer[17];
+        ASSERT_EQ(pread(fd, buffer, 17, pos), 17);
+        ASSERT_EQ(memcmp(buffer, "LOCATED-LUMP-DATA", 17), 0);
+        testWad->releaseLocated();
+
+        delete testWad;
+        testWad = Wad::loadWad(wad_path);
+        ASSERT_EQ(testWad->getContents("/z", buffer, 17), 17);
+        ASSERT_EQ(memcmp(buffer, "SECRET-OTHER-LUMP", 17), 0);
+        delete testWad;
+}
+
+TEST(LibWriteTests, compactTest1){
+        for (LoadMode mode : {LoadMode::Buffered, LoadMode::Mmap}) {
+                std::string wad_path = setupWorkspace();
+                Wad* testWad = Wad::loadWad(wad_path, mode);
+
+                //compact Test 1, scattered lumps are rewritten in table order with no gaps
+                std::vector<char> data(6000, 'z');
+                testWad->createFile("/Gl/big.txt");
+                ASSERT_EQ(testWad->writeToFile("/Gl/big.txt", data.data(), 2000), 2000);
+                ASSERT_EQ(testWad->flush(), 0);
+                ASSERT_EQ(testWad->writeToFile("/Gl/big.txt", data.data(), 4000, 2000), 4000);
+                ASSERT_EQ(testWad->writeToFile("/mp.txt", "!", 1, 1000), 1);
+                int64_t handle = testWad->openLump("/Gl/big.txt");
+
+                //Snapshot every lump in table order
+                std::vector<std::string> paths;
+                std::vector<std::string> stack = { "" };
+                testWad->walkTree("/", [&](int depth, std::string_view name, const EntryInfo& info) {
+                        stack.resize(depth + 1);
+                        std::string path = stack[depth] + "/" + std::string(name);
+                        if (info.kind == EntryKind::Directory)
+                                stack.push_back(path);
+                        else
+                                paths.push_back(path);
+                });
+                auto contents = [&](Wad* wad) {
+                        std::vector<std::string> all;
+                        for (const std::string& path : paths) {
+                                std::string bytes(wad->getSize(path), '\0');
+                                wad->getContents(path, bytes.data(), bytes.size());
+                                all.push_back(bytes);
+                        }
+                        return all;
+                };
+                std::vector<std::string> expected = contents(testWad);
+
+                //Not while another Wad has the file loaded
+                Wad* readerWad = Wad::loadWad(wad_path, mode);
+                ASSERT_EQ(testWad->compact(), -1);
+                ASSERT_EQ(errno, EWOULDBLOCK);
+                delete readerWad;
+
+                ASSERT_EQ(testWad->compact(), 0);
+                ASSERT_EQ(contents(testWad), expected);
+                ASSERT_EQ(testWad->readLump(handle, data.data(), 6000), 6000);
+                ASSERT_EQ(access((wad_path + ".compact").c_str(), F_OK), -1);
+
+                //Data starts after the header and each lump follows the previous one
+                uint64_t next = sizeof(Header);
+                for (const std::string& path : paths) {
+                        EntryInfo info = testWad->stat(path);
+                        if (info.size == 0)
+                                continue;
+                        ASSERT_EQ(info.offset, next) << path;
+                        next += info.size;
+                }
+                Header header;
+                int fd = open(wad_path.c_str(), O_RDONLY);
+                ASSERT_EQ(pread(fd, &header, sizeof(header), 0), (ssize_t)sizeof(header));
+                close(fd);
+                ASSERT_EQ(header.offset, next);
+                struct stat st;
+                ASSERT_EQ(stat(wad_path.c_str(), &st), 0);
+                ASSERT_EQ((uint64_t)st.st_size, next + header.count * sizeof(Descriptor));
+
+                //Writers are not held off during the copy, it is redone if they changed something
+                std::thread writer([&]() {
+                        for (int i = 0; i < 200; ++i)
+                                testWad->writeToFile("/mp.txt", "W", 1, 2000);
+                });
+                int rc = testWad->compact();
+                int err = errno;
+                writer.join();
+                ASSERT_TRUE(rc == 0 || err == EAGAIN);
+                ASSERT_EQ(testWad->getSize("/mp.txt"), 2001);
+                expected = contents(testWad);
+
+                //Still writable, and the result loads
+                ASSERT_EQ(testWad->writeToFile("/E1M0/01.txt", "Jo", 2), 2);
+                expected[0].replace(0, 2, "Jo");
+                delete testWad;
+                testWad = Wad::loadWad(wad_path);
+                ASSERT_EQ(contents(testWad), expected);
+                delete testWad;
+        }
+}
+
+TEST(LibWriteTests, compactTest2){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path, LoadMode::Mmap);
+
+        //compact Test 2, the swap waits for located ranges to be released
+        int fd = -1;
+        uint64_t pos = 0;
+        int64_t handle = testWad->openLump("/mp.txt");
+        ASSERT_EQ(testWad->locateLump(handle, 17, 117, &fd, &pos), 17);
+        ASSERT_GE(fd, 0);
+        std::atomic<bool> done { false };
+        int rc = -1;
+        std::thread compactor([&]() {
+                rc = testWad->compact();
+                done = true;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        ASSERT_FALSE(done);
+        char buffer[17];
+        ASSERT_EQ(pread(fd, buffer, 17, pos), 17);
+        ASSERT_EQ(memcmp(buffer, "airspeed velocity", 17), 0);
+        testWad->releaseLocated();
+        compactor.join();
+        ASSERT_EQ(rc, 0);
+        ASSERT_EQ(testWad->readLump(handle, buffer, 17, 117), 17);
+        ASSERT_EQ(memcmp(buffer, "airspeed velocity", 17), 0);
+
+        //A Wad whose file was replaced by another compaction refuses to write back
+        std::string other_path = wad_path + ".other";
+        ASSERT_EQ(system(("cp " + wad_path + " " + other_path).c_str()), 0);
+        ASSERT_EQ(rename(other_path.c_str(), wad_path.c_str()), 0);
+        ASSERT_EQ(testWad->compact(), -1);
+        ASSERT_EQ(errno, ESTALE);
+        ASSERT_EQ(testWad->writeToFile("/mp.txt", "x", 1), 1);
+        ASSERT_EQ(testWad->flush(), -1);
+        ASSERT_EQ(errno, ESTALE);
+        delete testWad;
+}
+
+TEST(LibWriteTests, flushTest1){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path);
+
+        //flush Test 1, changes are visible to a second reader after flush
+        testWad->createDirectory("/ex");
+        testWad->createFile("/ex/file.txt");
+        const char testWriteContent[] = "Example text";
+        int sizeOfWrite = sizeof(testWriteContent);
+        ASSERT_EQ(testWad->writeToFile("/ex/file.txt", testWriteContent, sizeOfWrite), sizeOfWrite);
+        ASSERT_EQ(testWad->flush(), 0);
+
+        Wad* readerWad = Wad::loadWad(wad_path, LoadMode::Mmap);
+        ASSERT_TRUE(readerWad->isDirectory("/ex"));
+        ASSERT_EQ(readerWad->getSize("/ex/file.txt"), sizeOfWrite);
+
+        char buffer[100];
+        memset(buffer, 0, 100);
+        ASSERT_EQ(readerWad->getContents("/ex/file.txt", buffer, sizeOfWrite), sizeOfWrite);
+        ASSERT_EQ(memcmp(buffer, testWriteContent, sizeOfWrite), 0);
+
+        //Flushing again with nothing pending is a no-op
+        ASSERT_EQ(testWad->flush(), 0);
+
+        delete readerWad;
+        delete testWad;
+}
+
+TEST(LibWriteTests, flushTest2){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path);
+        struct stat st;
+        ASSERT_EQ(stat(wad_path.c_str(), &st), 0);
+
+        //flush Test 2, a flush cut short by the file size limit leaves the archive loadable
+        std::vector<char> data(100, 'n');
+        testWad->createFile("/new");
+        ASSERT_EQ(testWad->writeToFile("/new", data.data(), 100), 100);
+
+        struct rlimit saved;
+        getrlimit(RLIMIT_FSIZE, &saved);
+        struct rlimit capped = saved;
+        capped.rlim_cur = st.st_size + 50;
+        signal(SIGXFSZ, SIG_IGN);
+        setrlimit(RLIMIT_FSIZE, &capped);
+        int result = testWad->flush();
+        setrlimit(RLIMIT_FSIZE, &saved);
+        signal(SIGXFSZ, SIG_DFL);
+        ASSERT_EQ(result, -1);
+
+        Wad* readerWad = Wad::loadWad(wad_path);
+        ASSERT_NE(readerWad, nullptr);
+        ASSERT_FALSE(readerWad->isContent("/new"));
+        char buffer[100];
+        ASSERT_EQ(readerWad->getContents("/E1M0/01.txt", buffer, 17), 17);
+        ASSERT_EQ(memcmp(buffer, "He loves to sing\n", 17), 0);
+        delete readerWad;
+
+        //Retrying once there is room succeeds
+        ASSERT_EQ(testWad->flush(), 0);
+        delete testWad;
+        testWad = Wad::loadWad(wad_path);
+        ASSERT_EQ(testWad->getContents("/new", buffer, 100), 100);
+        ASSERT_EQ(memcmp(buffer, data.data(), 100), 0);
+        delete testWad;
+}
+
 TEST(LibFunctionalityTests, bigTest){
         std::string wad_path = setupWorkspace();
         Wad* testWad = Wad::loadWad(wad_path);
@@ -1164,3 +1979,103 @@ TEST(LibFunctionalityTests, bigTest){
 
         delete testWad;
 }
+
+TEST(LibFunctionalityTests, concurrentTest){
+        std::string wad_path = setupWorkspace();
+        Wad* testWad = Wad::loadWad(wad_path, LoadMode::Mmap);
+
+        //Readers stream a lump while a writer keeps adding files
+        const char inputText[] = "Example text";
+        int inputSize = sizeof(inputText);
+        std::vector<std::thread> readers;
+        std::vector<int> failures(4, 0);
+
+        for (int t = 0; t < 4; t++) {
+                readers.emplace_back([&, t]() {
+                        char buffer[100];
+                        for (int i = 0; i < 2000; i++) {
+                                if (testWad->getContents("/E1M0/01.txt", buffer, 17) != 17
+                                    || memcmp(buffer, "He loves to sing\n", 17) != 0)
+                                        failures[t]++;
+                                if (!testWad->isDirectory("/Gl/ad/os"))
+                                        failures[t]++;
+                        }
+                });
+        }
+
+        for (int i = 0; i < 200; i++) {
+                std::string path = "/Gl/f" + std::to_string(i);
+                testWad->createFile(path);
+                ASSERT_EQ(testWad->writeToFile(path, inputText, inputSize), inputSize);
+        }
+
+        for (std::thread& reader : readers)
+                reader.join();
+        for (int count : failures)
+                ASSERT_EQ(count, 0);
+
+        std::vector<std::string> testVector;
+        ASSERT_EQ(testWad->getDirectory("/Gl", &testVector), 201);
+
+        delete testWad;
+}
+
+TEST(LibFunctionalityTests, parallelLoadTest){
+        //Table large enough to be split across parse threads
+        const std::string wad_path = "./testfiles/parallel.wad";
+        const int namespaces = 100;
+        const int lumps = 1000;
+
+        std::vector<Descriptor> table;
+        auto descriptor = [](const std::string& name, uint32_t offset, uint32_t length) {
+                Descriptor d { offset, length, {} };
+                memcpy(d.name, name.data(), std::min<size_t>(name.size(), 8));
+                return d;
+        };
+        for (int ns = 0; ns < namespaces; ns++) {
+                std::string prefix = std::string(ns < 10 ? "0" : "") + std::to_string(ns);
+                table.push_back(descriptor(prefix + "_START", 0, 0));
+                for (int i = 0; i < lumps; i++)
+                        table.push_back(descriptor("L" + std::to_string(i), sizeof(Header), 4));
+                table.push_back(descriptor(prefix + "_END", 0, 0));
+        }
+
+        Header header { {'P', 'W', 'A', 'D'}, (uint32_t)table.size(), sizeof(Header) + 4 };
+        auto writeWad = [&]() {
+                FILE* f = fopen(wad_path.c_str(), "wb");
+                fwrite(&header, sizeof(header), 1, f);
+                fwrite("data", 4, 1, f);
+                fwrite(table.data(), sizeof(Descriptor), table.size(), f);
+                fclose(f);
+        };
+        writeWad();
+
+        std::vector<std::string> expectedVector;
+        Wad::setLoadThreads(1);
+        Wad* serialWad = Wad::loadWad(wad_path);
+        ASSERT_NE(serialWad, nullptr);
+        ASSERT_EQ(serialWad->getDirectory("/", &expectedVector), namespaces);
+
+        Wad::setLoadThreads(4);
+        Wad* parallelWad = Wad::loadWad(wad_path);
+        ASSERT_NE(parallelWad, nullptr);
+        for (int ns = 0; ns < namespaces; ns += 33) {
+                std::string dir = "/" + expectedVector[ns];
+                std::vector<std::string> serialVector;
+                std::vector<std::string> parallelVector;
+                ASSERT_EQ(parallelWad->getDirectory(dir, &parallelVector), lumps);
+                ASSERT_EQ(serialWad->getDirectory(dir, &serialVector), lumps);
+                ASSERT_EQ(parallelVector, serialVector);
+                ASSERT_EQ(parallelWad->getSize(dir + "/L999"), 4);
+        }
+        delete serialWad;
+        delete parallelWad;
+
+        //A lump past the end of the file in the last chunk still fails the load
+        table[table.size() - 2].offset = 1 << 30;
+        writeWad();
+        ASSERT_EQ(Wad::loadWad(wad_path), nullptr);
+
+        Wad::setLoadThreads(0);
+        unlink(wad_path.c_str());
+}
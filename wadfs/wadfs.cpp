@@ -3,19 +3,17 @@
 #include <cstdio>
 #include <cstring>
 #include <cerrno>
+#include <cstddef>
 #include <cstdlib>
 #include <string>
+#include <string_view>
 #include <vector>
 #include "../libWad/Wad.h"
+#include "wadfs_common.h"
 
-static Wad* g_wad = nullptr;   // loaded WAD handle
+static Wad* g_wad = nullptr;   // loaded WAD handle, safe to share between FUSE threads
 
-/* ------------------------------------------------------------- */
-/*  Helpers                                                      */
-/* ------------------------------------------------------------- */
-static bool path_is_root(const char* path) {
-    return std::strcmp(path, "/") == 0;
-}
+static wadfs_config g_config;
 
 /* ------------------------------------------------------------- */
 /*  FUSE callbacks                                               */
@@ -23,28 +21,8 @@ static bool path_is_root(const char* path) {
 
 static int wadfs_getattr(const char* path, struct stat* stbuf)
 {
-    memset(stbuf, 0, sizeof(struct stat));
-
-    if (path_is_root(path)) {
-        stbuf->st_mode  = S_IFDIR | 0777;
-        stbuf->st_nlink = 2;
-        return 0;
-    }
-
-    if (g_wad->isDirectory(path)) {
-        stbuf->st_mode  = S_IFDIR | 0777;
-        stbuf->st_nlink = 2;
-        return 0;
-    }
-
-    if (g_wad->isContent(path)) {
-        stbuf->st_mode  = S_IFREG | 0777;
-        stbuf->st_nlink = 1;
-        stbuf->st_size  = g_wad->getSize(path);
-        return 0;
-    }
-
-    return -ENOENT;
+    // One lookup answers kind and size
+    return fill_stat(g_wad->stat(path), stbuf) ? 0 : -ENOENT;
 }
 
 static int wadfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
@@ -54,41 +32,51 @@ static int wadfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
     filler(buf, ".",  nullptr, 0);
     filler(buf, "..", nullptr, 0);
 
-    // root directory
-    if (path_is_root(path)) {
-        std::vector<std::string> list;
-        g_wad->getDirectory("/", &list);
-        for (const auto& name : list) filler(buf, name.c_str(), nullptr, 0);
-        return 0;
-    }
-
-    // other directories
-    if (!g_wad->isDirectory(path)) return -ENOTDIR;
-
-    std::vector<std::string> entries;
-    g_wad->getDirectory(path, &entries);
-    for (const auto& n : entries) filler(buf, n.c_str(), nullptr, 0);
+    // Names and attributes come straight from the tree, visiting fails for anything that is
+    // not a directory
+    struct stat st;
+    int count = g_wad->visitDirectory(path, [&](std::string_view name, const EntryInfo& info) {
+        fill_stat(info, &st);
+        filler(buf, name.data(), &st, 0);
+    });
+    if (count < 0)
+        return g_wad->stat(path).kind == EntryKind::Missing ? -ENOENT : -ENOTDIR;
 
     return 0;
 }
 
-static int wadfs_read(const char* path, char* buf, size_t size, off_t offset,
-                      struct fuse_file_info* /*fi*/)
+static int wadfs_open(const char* path, struct fuse_file_info* fi)
+{
+    // Resolve once, read/write then go straight to the lump
+    return wadfs_open_lump(g_wad->stat(path), g_config, fi);
+}
+
+static int wadfs_read(const char* /*path*/, char* buf, size_t size, off_t offset,
+                      struct fuse_file_info* fi)
 {
-    int n = g_wad->getContents(path, buf, static_cast<int>(size), static_cast<int>(offset));
+    // Copied rather than spliced with locateLump: the high-level library sends a read_buf
+    // reply after the callback returns, too late to release the located range
+    int n = g_wad->readLump(static_cast<int64_t>(fi->fh), buf, static_cast<int>(size),
+                            static_cast<int>(offset));
     return (n < 0) ? -EIO : n;
 }
 
-static int wadfs_write(const char* path, const char* buf, size_t size, off_t offset,
-                       struct fuse_file_info* /*fi*/)
+static int wadfs_write(const char* /*path*/, const char* buf, size_t size, off_t offset,
+                       struct fuse_file_info* fi)
 {
-    int n = g_wad->writeToFile(path, buf, static_cast<int>(size), static_cast<int>(offset));
+    int n = g_wad->writeLump(static_cast<int64_t>(fi->fh), buf, static_cast<int>(size),
+                             static_cast<int>(offset));
     return (n < 0) ? -EIO : n;
 }
 
+static int wadfs_truncate(const char* path, off_t size)
+{
+    return wadfs_truncate_lump(g_wad, g_wad->stat(path), size);
+}
+
 static int wadfs_mkdir(const char* path, mode_t /*mode*/)
 {
-    if (g_wad->isContent(path) || g_wad->isDirectory(path)) return -EEXIST;
+    if (g_wad->stat(path).kind != EntryKind::Missing) return -EEXIST;
     g_wad->createDirectory(path);
     return 0;
 }
@@ -96,11 +84,22 @@ static int wadfs_mkdir(const char* path, mode_t /*mode*/)
 static int wadfs_mknod(const char* path, mode_t mode, dev_t /*dev*/)
 {
     if (!S_ISREG(mode)) return -EPERM; // only regular files supported
-    if (g_wad->isContent(path) || g_wad->isDirectory(path)) return -EEXIST;
+    if (g_wad->stat(path).kind != EntryKind::Missing) return -EEXIST;
     g_wad->createFile(path);
     return 0;
 }
 
+static int wadfs_fsync(const char* /*path*/, int /*datasync*/, struct fuse_file_info* /*fi*/)
+{
+    return (g_wad->sync() < 0) ? -EIO : 0;
+}
+
+static void wadfs_destroy(void* /*private_data*/)
+{
+    // Persist changes on unmount
+    g_wad->sync();
+}
+
 /* ------------------------------------------------------------- */
 /*  main                                                          */
 /* ------------------------------------------------------------- */
@@ -109,35 +108,38 @@ static struct fuse_operations wadfs_ops; // zero‑initialised global
 
 int main(int argc, char* argv[])
 {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s [-s] <wadfile> <mountpoint> [FUSE opts]\n", argv[0]);
+    std::vector<char*> fuse_argv;
+    g_wad = wadfs_load(argc, argv, fuse_argv);
+    if (!g_wad)
         return 1;
-    }
-
-    // wad file is second‑last argument, mountpoint is last.
-    std::string wadPath = argv[argc - 2];
-
-    g_wad = Wad::loadWad(wadPath);
-    if (!g_wad) {
-        fprintf(stderr, "Failed to load WAD %s\n", wadPath.c_str());
+    struct fuse_args args = FUSE_ARGS_INIT(static_cast<int>(fuse_argv.size()), fuse_argv.data());
+    if (wadfs_parse_opts(&args, &g_config) < 0) {
+        delete g_wad;
         return 1;
     }
 
-    // remove wadPath from argv so FUSE doesn't see it
-    std::vector<char*> fuse_argv;
-    for (int i = 0; i < argc; ++i) if (i != argc - 2) fuse_argv.push_back(argv[i]);
-    int fuse_argc = static_cast<int>(fuse_argv.size());
+    // The high-level library applies the cache timeouts itself
+    char timeouts[128];
+    snprintf(timeouts, sizeof(timeouts), "-oattr_timeout=%g,entry_timeout=%g,negative_timeout=%g",
+             g_config.attr_timeout, g_config.entry_timeout, g_config.negative_timeout);
+    fuse_opt_insert_arg(&args, 1, timeouts);
 
     // fill operations table
     wadfs_ops.getattr = wadfs_getattr;
     wadfs_ops.readdir = wadfs_readdir;
+    wadfs_ops.open    = wadfs_open;
     wadfs_ops.read    = wadfs_read;
     wadfs_ops.write   = wadfs_write;
+    wadfs_ops.truncate = wadfs_truncate;
     wadfs_ops.mkdir   = wadfs_mkdir;
     wadfs_ops.mknod   = wadfs_mknod;
+    wadfs_ops.fsync   = wadfs_fsync;
+    wadfs_ops.destroy = wadfs_destroy;
 
-    int ret = fuse_main(fuse_argc, fuse_argv.data(), &wadfs_ops, nullptr);
+    // Multithreaded unless -s is passed, Wad serializes writers internally
+    int ret = fuse_main(args.argc, args.argv, &wadfs_ops, nullptr);
 
+    fuse_opt_free_args(&args);
     delete g_wad;
     return ret;
 }
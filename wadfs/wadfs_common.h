@@ -0,0 +1,115 @@
+#pragma once
+// Pieces shared by the path (wadfs.cpp) and inode (wadfs_ll.cpp) frontends
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fuse_common.h>
+#include <fuse_opt.h>
+#include <sys/stat.h>
+#include "../libWad/Wad.h"
+
+// wadfs mount options, taken out of the arguments before FUSE parses them
+struct wadfs_config {
+    int immutable;   // -o immutable: lump data only changes through this mount
+    // Kernel cache timeouts in seconds, negative until parsed or defaulted
+    double attr_timeout;
+    double entry_timeout;
+    double negative_timeout;
+};
+
+static const struct fuse_opt wadfs_opts[] = {
+    { "immutable", offsetof(wadfs_config, immutable), 1 },
+    { "attr_timeout=%lf", offsetof(wadfs_config, attr_timeout), 0 },
+    { "entry_timeout=%lf", offsetof(wadfs_config, entry_timeout), 0 },
+    { "negative_timeout=%lf", offsetof(wadfs_config, negative_timeout), 0 },
+    FUSE_OPT_END
+};
+
+// Load the WAD named by the second-last argument. fuse_argv gets the other arguments.
+static inline Wad* wadfs_load(int argc, char* argv[], std::vector<char*>& fuse_argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s [FUSE opts] [-o immutable] <wadfile> <mountpoint>\n", argv[0]);
+        return nullptr;
+    }
+
+    // wad file is second‑last argument, mountpoint is last.
+    std::string wadPath = argv[argc - 2];
+
+    // Map the archive and build the tree lazily, mounting costs one table scan
+    Wad* wad = Wad::loadWad(wadPath, LoadMode::Mmap, TreeMode::Lazy);
+    if (!wad) {
+        fprintf(stderr, "Failed to load WAD %s\n", wadPath.c_str());
+        return nullptr;
+    }
+
+    // remove wadPath from argv so FUSE doesn't see it
+    for (int i = 0; i < argc; ++i) if (i != argc - 2) fuse_argv.push_back(argv[i]);
+    return wad;
+}
+
+// Take the wadfs options out of args and default the timeouts left unset
+static inline int wadfs_parse_opts(struct fuse_args* args, wadfs_config* config)
+{
+    *config = { 0, -1.0, -1.0, -1.0 };
+    if (fuse_opt_parse(args, config, wadfs_opts, nullptr) < 0)
+        return -1;
+
+    // Every change goes through this mount, so the kernel may cache lookups and attributes
+    // for long, and immutable mounts for longer
+    double long_timeout = config->immutable ? 3600.0 : 60.0;
+    if (config->attr_timeout < 0) config->attr_timeout = long_timeout;
+    if (config->entry_timeout < 0) config->entry_timeout = long_timeout;
+    if (config->negative_timeout < 0) config->negative_timeout = config->immutable ? 60.0 : 10.0;
+    return 0;
+}
+
+// Attributes of an entry, inode number being its handle. False if it does not exist.
+static inline bool fill_stat(const EntryInfo& info, struct stat* stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = info.handle;
+
+    if (info.kind == EntryKind::Directory) {
+        stbuf->st_mode  = S_IFDIR | 0777;
+        stbuf->st_nlink = 2;
+        return true;
+    }
+
+    if (info.kind == EntryKind::Content) {
+        stbuf->st_mode  = S_IFREG | 0777;
+        stbuf->st_nlink = 1;
+        stbuf->st_size  = info.size;
+        return true;
+    }
+
+    return false;
+}
+
+// Open a lump: fi->fh becomes its handle. Returns 0 or a negative errno.
+static inline int wadfs_open_lump(const EntryInfo& info, const wadfs_config& config,
+                                  struct fuse_file_info* fi)
+{
+    if (info.kind != EntryKind::Content)
+        return info.kind == EntryKind::Directory ? -EISDIR : -ENOENT;
+    fi->fh = static_cast<uint64_t>(info.handle);
+
+    // Writes and truncates go through the kernel, which updates its own cached pages, so
+    // nothing can make them stale and they can outlive this open
+    fi->keep_cache = config.immutable;
+    return 0;
+}
+
+// Resize a lump, O_TRUNC and resizes from tools like cp and dd land here. Returns 0 or a
+// negative errno.
+static inline int wadfs_truncate_lump(Wad* wad, const EntryInfo& info, off_t size)
+{
+    if (info.kind == EntryKind::Missing) return -ENOENT;
+    if (info.kind == EntryKind::Directory) return -EISDIR;
+    if (size < 0 || size > UINT32_MAX) return -EFBIG;
+    return (wad->truncateLump(info.handle, static_cast<uint32_t>(size)) < 0) ? -EIO : 0;
+}
@@ -0,0 +1,299 @@
+#define FUSE_USE_VERSION 26
+#include <fuse_lowlevel.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../libWad/Wad.h"
+#include "wadfs_common.h"
+
+// Inode frontend: FUSE inode numbers are Wad handles, which are node ids that never change
+// while the WAD is mounted. The root's handle is 1, which is FUSE_ROOT_ID. Each callback
+// goes straight to its node without building or resolving a path.
+
+static Wad* g_wad = nullptr;   // loaded WAD handle, safe to share between FUSE threads
+
+static wadfs_config g_config;
+
+static_assert(FUSE_ROOT_ID == 1, "the root handle doubles as the FUSE root inode");
+
+/* ------------------------------------------------------------- */
+/*  Helpers                                                      */
+/* ------------------------------------------------------------- */
+
+// Reply to a lookup-like request with an entry, or a cached negative entry if missing
+static void reply_entry(fuse_req_t req, const EntryInfo& info)
+{
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+
+    if (!fill_stat(info, &e.attr)) {
+        // ino 0 lets the kernel remember the miss
+        e.entry_timeout = g_config.negative_timeout;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    e.ino = static_cast<fuse_ino_t>(info.handle);
+    e.generation = 1;
+    e.attr_timeout = g_config.attr_timeout;
+    e.entry_timeout = g_config.entry_timeout;
+    fuse_reply_entry(req, &e);
+}
+
+static void reply_attr(fuse_req_t req, fuse_ino_t ino)
+{
+    struct stat st;
+    if (!fill_stat(g_wad->stat(static_cast<int64_t>(ino)), &st)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fuse_reply_attr(req, &st, g_config.attr_timeout);
+}
+
+// Directory listing built at opendir and served in slices, so paging through a large
+// directory does not walk it once per readdir call
+struct dir_listing {
+    std::vector<char> buf;
+};
+
+static void add_entry(fuse_req_t req, dir_listing* listing, const char* name, const struct stat* st)
+{
+    size_t old = listing->buf.size();
+    size_t size = fuse_add_direntry(req, nullptr, 0, name, nullptr, 0);
+    listing->buf.resize(old + size);
+    fuse_add_direntry(req, listing->buf.data() + old, size, name, st, old + size);
+}
+
+/* ------------------------------------------------------------- */
+/*  FUSE callbacks                                               */
+/* ------------------------------------------------------------- */
+
+static void wadfs_init(void* /*userdata*/, struct fuse_conn_info* conn)
+{
+    // Let the kernel splice read replies instead of copying them
+    conn->want |= FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+}
+
+static void wadfs_destroy(void* /*userdata*/)
+{
+    g_wad->sync();
+}
+
+static void wadfs_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    // One hash lookup under the parent
+    reply_entry(req, g_wad->lookupChild(static_cast<int64_t>(parent), name));
+}
+
+static void wadfs_forget(fuse_req_t req, fuse_ino_t /*ino*/, unsigned long /*nlookup*/)
+{
+    // Handles live as long as the Wad, nothing to release
+    fuse_reply_none(req);
+}
+
+static void wadfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* /*fi*/)
+{
+    reply_attr(req, ino);
+}
+
+static void wadfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
+                          struct fuse_file_info* /*fi*/)
+{
+    // Only sizes can change, anything else is answered with the current attributes
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        int res = wadfs_truncate_lump(g_wad, g_wad->stat(static_cast<int64_t>(ino)), attr->st_size);
+        if (res < 0) { fuse_reply_err(req, -res); return; }
+    }
+    reply_attr(req, ino);
+}
+
+static void wadfs_mknod(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode,
+                        dev_t /*rdev*/)
+{
+    if (!S_ISREG(mode)) { fuse_reply_err(req, EPERM); return; } // only regular files supported
+    int64_t dir = static_cast<int64_t>(parent);
+    if (g_wad->lookupChild(dir, name).kind != EntryKind::Missing) { fuse_reply_err(req, EEXIST); return; }
+
+    int64_t handle = g_wad->createFile(dir, name);
+    if (handle < 0) { fuse_reply_err(req, EINVAL); return; }
+    reply_entry(req, g_wad->stat(handle));
+}
+
+static void wadfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t /*mode*/)
+{
+    int64_t dir = static_cast<int64_t>(parent);
+    if (g_wad->lookupChild(dir, name).kind != EntryKind::Missing) { fuse_reply_err(req, EEXIST); return; }
+
+    int64_t handle = g_wad->createDirectory(dir, name);
+    if (handle < 0) { fuse_reply_err(req, EINVAL); return; }
+    reply_entry(req, g_wad->stat(handle));
+}
+
+static void wadfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    int res = wadfs_open_lump(g_wad->stat(static_cast<int64_t>(ino)), g_config, fi);
+    if (res < 0) { fuse_reply_err(req, -res); return; }
+    fuse_reply_open(req, fi);
+}
+
+static void wadfs_read(fuse_req_t req, fuse_ino_t /*ino*/, size_t size, off_t offset,
+                       struct fuse_file_info* fi)
+{
+    int64_t handle = static_cast<int64_t>(fi->fh);
+    int fd;
+    uint64_t pos;
+    int n = g_wad->locateLump(handle, static_cast<int>(size), static_cast<int>(offset), &fd, &pos);
+    if (n < 0) { fuse_reply_err(req, EIO); return; }
+
+    if (fd >= 0 && n > 0) {
+        // Point at the WAD file so the kernel can splice from the page cache
+        struct fuse_bufvec src = FUSE_BUFVEC_INIT(static_cast<size_t>(n));
+        src.buf[0].flags = static_cast<enum fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        src.buf[0].fd    = fd;
+        src.buf[0].pos   = static_cast<off_t>(pos);
+        fuse_reply_data(req, &src, FUSE_BUF_SPLICE_MOVE);
+        // The reply has been read from the file, its range may be reused now
+        g_wad->releaseLocated();
+        return;
+    }
+
+    // Not flushed yet, serve from memory
+    if (fd >= 0)
+        g_wad->releaseLocated();
+    std::vector<char> buf(n);
+    if (n > 0)
+        n = g_wad->readLump(handle, buf.data(), n, static_cast<int>(offset));
+    if (n < 0) { fuse_reply_err(req, EIO); return; }
+    fuse_reply_buf(req, buf.data(), n);
+}
+
+static void wadfs_write(fuse_req_t req, fuse_ino_t /*ino*/, const char* buf, size_t size,
+                        off_t offset, struct fuse_file_info* fi)
+{
+    int n = g_wad->writeLump(static_cast<int64_t>(fi->fh), buf, static_cast<int>(size),
+                             static_cast<int>(offset));
+    if (n < 0) { fuse_reply_err(req, EIO); return; }
+    fuse_reply_write(req, n);
+}
+
+static void wadfs_fsync(fuse_req_t req, fuse_ino_t /*ino*/, int /*datasync*/,
+                        struct fuse_file_info* /*fi*/)
+{
+    fuse_reply_err(req, g_wad->sync() < 0 ? EIO : 0);
+}
+
+static void wadfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    dir_listing* listing = new dir_listing;
+    struct stat st;
+
+    // always add . and ..
+    memset(&st, 0, sizeof(st));
+    st.st_ino = ino;
+    st.st_mode = S_IFDIR;
+    add_entry(req, listing, ".", &st);
+    add_entry(req, listing, "..", &st);
+
+    // The whole listing now, readdir only slices it
+    int count = g_wad->visitDirectory(static_cast<int64_t>(ino),
+        [&](std::string_view name, const EntryInfo& info) {
+            fill_stat(info, &st);
+            add_entry(req, listing, name.data(), &st);
+        });
+    if (count < 0) {
+        delete listing;
+        fuse_reply_err(req, g_wad->stat(static_cast<int64_t>(ino)).kind == EntryKind::Missing ? ENOENT : ENOTDIR);
+        return;
+    }
+
+    fi->fh = reinterpret_cast<uint64_t>(listing);
+    fuse_reply_open(req, fi);
+}
+
+static void wadfs_readdir(fuse_req_t req, fuse_ino_t /*ino*/, size_t size, off_t offset,
+                          struct fuse_file_info* fi)
+{
+    // Entry offsets are byte positions in the listing
+    const dir_listing* listing = reinterpret_cast<const dir_listing*>(fi->fh);
+    size_t off = static_cast<size_t>(offset);
+    if (off >= listing->buf.size()) {
+        fuse_reply_buf(req, nullptr, 0);
+        return;
+    }
+    fuse_reply_buf(req, listing->buf.data() + off, std::min(size, listing->buf.size() - off));
+}
+
+static void wadfs_releasedir(fuse_req_t req, fuse_ino_t /*ino*/, struct fuse_file_info* fi)
+{
+    delete reinterpret_cast<dir_listing*>(fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+/* ------------------------------------------------------------- */
+/*  main                                                          */
+/* ------------------------------------------------------------- */
+
+static struct fuse_lowlevel_ops wadfs_ops; // zero‑initialised global
+
+int main(int argc, char* argv[])
+{
+    std::vector<char*> fuse_argv;
+    g_wad = wadfs_load(argc, argv, fuse_argv);
+    if (!g_wad)
+        return 1;
+    struct fuse_args args = FUSE_ARGS_INIT(static_cast<int>(fuse_argv.size()), fuse_argv.data());
+    if (wadfs_parse_opts(&args, &g_config) < 0) {
+        delete g_wad;
+        return 1;
+    }
+
+    // fill operations table
+    wadfs_ops.init       = wadfs_init;
+    wadfs_ops.destroy    = wadfs_destroy;
+    wadfs_ops.lookup     = wadfs_lookup;
+    wadfs_ops.forget     = wadfs_forget;
+    wadfs_ops.getattr    = wadfs_getattr;
+    wadfs_ops.setattr    = wadfs_setattr;
+    wadfs_ops.mknod      = wadfs_mknod;
+    wadfs_ops.mkdir      = wadfs_mkdir;
+    wadfs_ops.open       = wadfs_open;
+    wadfs_ops.read       = wadfs_read;
+    wadfs_ops.write      = wadfs_write;
+    wadfs_ops.fsync      = wadfs_fsync;
+    wadfs_ops.opendir    = wadfs_opendir;
+    wadfs_ops.readdir    = wadfs_readdir;
+    wadfs_ops.releasedir = wadfs_releasedir;
+
+    // Mount and run the session, multithreaded unless -s is passed
+    char* mountpoint = nullptr;
+    int multithreaded = 0, foreground = 0;
+    int ret = 1;
+    struct fuse_chan* ch = nullptr;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1
+        && (ch = fuse_mount(mountpoint, &args)) != nullptr) {
+        struct fuse_session* se = fuse_lowlevel_new(&args, &wadfs_ops, sizeof(wadfs_ops), nullptr);
+        if (se) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                ret = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+
+    fuse_opt_free_args(&args);
+    delete g_wad;
+    return ret ? 1 : 0;
+}